@@ -50,10 +50,24 @@ ESP8266_AT_Class::ESP8266_AT_Class()
 
 ////////////////////////////////////////
 
-void ESP8266_AT_Class::init(Stream* espSerial)
+void ESP8266_AT_Class::init(Stream* espSerial, uint8_t recvMode)
 {
   AT_LOGINFO(F("Initializing ESP module"));
-  ESP8266_AT_Drv::wifiDriverInit(espSerial);
+  ESP8266_AT_Drv::wifiDriverInit(espSerial, recvMode);
+}
+
+////////////////////////////////////////
+
+uint8_t ESP8266_AT_Class::recvMode()
+{
+  return ESP8266_AT_Drv::recvMode();
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Class::setBaudRate(uint32_t baud, ATBaudRateHook hook, bool flowControl)
+{
+  return ESP8266_AT_Drv::setBaudRate(baud, hook, flowControl);
 }
 
 ////////////////////////////////////////
@@ -85,6 +99,36 @@ int ESP8266_AT_Class::begin(const char* ssid, const char* passphrase)
 
 ////////////////////////////////////////
 
+int8_t ESP8266_AT_Class::beginAsync(const char* ssid, const char* passphrase, ATCmdCallback callback)
+{
+  espMode = 1;
+
+  return ESP8266_AT_Drv::wifiConnectAsync(ssid, passphrase, callback);
+}
+
+////////////////////////////////////////
+
+int ESP8266_AT_Class::cmdResult(int8_t cmdId)
+{
+  return ESP8266_AT_Drv::cmdResult(cmdId);
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Class::poll()
+{
+  ESP8266_AT_Drv::poll();
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Class::onUrc(uint8_t urc, ATUrcCallback callback)
+{
+  ESP8266_AT_Drv::onUrc(urc, callback);
+}
+
+////////////////////////////////////////
+
 int ESP8266_AT_Class::beginAP(const char* ssid, uint8_t channel, const char* pwd, uint8_t enc, bool apOnly)
 {
   if (apOnly)
@@ -311,6 +355,7 @@ void ESP8266_AT_Class::allocateSocket(uint8_t sock)
 void ESP8266_AT_Class::releaseSocket(uint8_t sock)
 {
   _state[sock] = NA_STATE;
+  _server_port[sock] = 0;
 }
 
 ////////////////////////////////////////
@@ -58,14 +58,32 @@ class ESP8266_AT_Class
       Initialize the ESP module.
 
       param espSerial: the serial interface (HW or SW) used to communicate with the ESP module
+      param recvMode: AT_RECV_PASSIVE, the default, to have the module keep the received data until there
+          is room for it, if the firmware supports it. AT_RECV_ACTIVE saves a round trip per read, but
+          loses what doesn't fit in the socket queue when a command is sent
     */
-    static void init(Stream* espSerial);
+    static void init(Stream* espSerial, uint8_t recvMode = AT_RECV_DEFAULT);
+
+    /**
+      Receive mode in use, AT_RECV_ACTIVE or AT_RECV_PASSIVE
+    */
+    static uint8_t recvMode();
 
     /**
       Get firmware version
     */
     static char* firmwareVersion();
 
+    /**
+      Negotiate a faster UART rate (921600, 2000000, ... as supported by the module and the board)
+
+      param baud: the new rate
+      param hook: called to switch the host serial port, e.g. Serial1.begin(baud)
+      param flowControl: enable RTS/CTS, the hook must enable it on the host too
+      return: true if the module answers at the new rate, else both sides are back to the old one
+    */
+    static bool setBaudRate(uint32_t baud, ATBaudRateHook hook, bool flowControl = false);
+
     // NOT IMPLEMENTED
     //int begin(char* ssid);
 
@@ -82,6 +100,32 @@ class ESP8266_AT_Class
     */
     int begin(const char* ssid, const char* passphrase);
 
+    /**
+      Same as begin(), but returns at once. The join is completed by poll().
+
+      param callback: called with the result (AT_CMD_OK when connected), may be NULL
+      return: command id to pass to cmdResult(), or -1 if the command queue is full
+    */
+    int8_t beginAsync(const char* ssid, const char* passphrase, ATCmdCallback callback = NULL);
+
+    /**
+      Result of an asynchronous command, AT_CMD_PENDING while it still runs
+    */
+    int cmdResult(int8_t cmdId);
+
+    /**
+      Advance the queued AT commands. Call it from loop() if not using the WebServer
+    */
+    static void poll();
+
+    /**
+      Be told by poll() when the module sends an unsolicited result code
+
+      param urc: AT_URC_WIFI_DISCONNECT, AT_URC_LINK_CLOSED, ...
+      param callback: called with the URC and the link it concerns, NULL to stop
+    */
+    static void onUrc(uint8_t urc, ATUrcCallback callback);
+
     /**
       Change Ip configuration settings disabling the DHCP client
 
@@ -36,13 +36,24 @@
 
 ////////////////////////////////////////
 
-ESP8266_AT_Client::ESP8266_AT_Client() : _sock(255)
+uint8_t*  ESP8266_AT_Client::_txBuf[MAX_SOCK_NUM] = { NULL };
+uint16_t  ESP8266_AT_Client::_txCap[MAX_SOCK_NUM] = { 0 };
+uint16_t  ESP8266_AT_Client::_txLen[MAX_SOCK_NUM] = { 0 };
+
+uint16_t    ESP8266_AT_Client::_sliceSize = AT_SEND_MAX_SIZE;
+uint16_t    ESP8266_AT_Client::_sliceMin  = AT_CLIENT_SLICE_MIN;
+uint16_t    ESP8266_AT_Client::_sliceMax  = AT_SEND_MAX_SIZE;
+ATSendStats ESP8266_AT_Client::_sendStats = { 0, 0, 0, 0, 0 };
+
+////////////////////////////////////////
+
+ESP8266_AT_Client::ESP8266_AT_Client() : _sock(255), _txBufferSize(0)
 {
 }
 
 ////////////////////////////////////////
 
-ESP8266_AT_Client::ESP8266_AT_Client(uint8_t sock) : _sock(sock)
+ESP8266_AT_Client::ESP8266_AT_Client(uint8_t sock) : _sock(sock), _txBufferSize(0)
 {
 }
 
@@ -104,6 +115,45 @@ int ESP8266_AT_Client::connect(IPAddress ip, uint16_t port)
 
 ////////////////////////////////////////
 
+int ESP8266_AT_Client::connectPassthrough(const char* host, uint16_t port)
+{
+  AT_LOGINFO1(F("Connecting in passthrough mode to"), host);
+
+  _sock = ESP8266_AT_Class::getFreeSocket();
+
+  if (_sock == NO_SOCKET_AVAIL)
+  {
+    AT_LOGERROR(F("No socket available"));
+    return 0;
+  }
+
+  if (!ESP8266_AT_Drv::startPassthrough(host, port, _sock))
+  {
+    _sock = 255;
+    return 0;
+  }
+
+  ESP8266_AT_Class::allocateSocket(_sock);
+
+  // nothing left by the previous user of the socket
+  releaseTx(_sock);
+
+  return 1;
+}
+
+////////////////////////////////////////
+
+int ESP8266_AT_Client::connectPassthrough(IPAddress ip, uint16_t port)
+{
+  char s[16];
+
+  sprintf_P(s, PSTR("%d.%d.%d.%d"), ip[0], ip[1], ip[2], ip[3]);
+
+  return connectPassthrough(s, port);
+}
+
+////////////////////////////////////////
+
 /* Private method */
 int ESP8266_AT_Client::connect(const char* host, uint16_t port, uint8_t protMode)
 {
@@ -117,6 +167,9 @@ int ESP8266_AT_Client::connect(const char* host, uint16_t port, uint8_t protMode
       return 0;
 
     ESP8266_AT_Class::allocateSocket(_sock);
+
+    // nothing left by the previous user of the socket
+    releaseTx(_sock);
   }
   else
   {
@@ -137,78 +190,111 @@ size_t ESP8266_AT_Client::write(uint8_t b)
 ////////////////////////////////////////
 
 // KH rewrite to enable chunk-sending for large file
+size_t ESP8266_AT_Client::write(const uint8_t *buf, size_t size)
+{
+  if ( (size > 0) && allocTx() )
+  {
+    uint16_t cap = _txCap[_sock];
 
-#define AT_CLIENT_MAX_WRITE_RETRY       100
+    if ( (_txLen[_sock] + size > cap) && !sendTx() )
+      return 0;
 
-////////////////////////////////////////
+    if (size < cap)
+    {
+      memcpy(_txBuf[_sock] + _txLen[_sock], buf, size);
+      _txLen[_sock] += size;
 
-size_t ESP8266_AT_Client::write(const uint8_t *buf, size_t size)
-{
-  int written = 0;
-  int retry = AT_CLIENT_MAX_WRITE_RETRY;
+      if ( (_txLen[_sock] == cap) && !sendTx() )
+        return 0;
 
-  size_t totalBytesSent = 0;
-  size_t bytesRemaining = size;
+      return size;
+    }
 
-  uint16_t AT_CLIENT_SEND_MAX_SIZE = 2048;
+    // bigger than the buffer, no need to copy it
+  }
 
-  AT_LOGINFO3("ESP8266_AT_Client::write: size = ", size, ", MAX_SIZE =", AT_CLIENT_SEND_MAX_SIZE);
+  AT_LOGINFO3("ESP8266_AT_Client::write: size = ", size, ", slice =", _sliceSize);
 
-  if ( (_sock >= MAX_SOCK_NUM) || (size == 0) || buf[0] == 0 )
+  if ( (_sock >= MAX_SOCK_NUM) || (size == 0) )
   {
     setWriteError();
 
     return 0;
   }
 
-  while (retry)
+  ATIoVec iov = { buf, size, false };
+
+  return writev(&iov, 1);
+}
+
+////////////////////////////////////////
+
+size_t ESP8266_AT_Client::writev(const ATIoVec* iov, uint8_t count)
+{
+  size_t size = 0;
+
+  for (uint8_t i = 0; i < count; i++)
+    size += iov[i].len;
+
+  if (_sock >= MAX_SOCK_NUM)
   {
-    //written =  Ethernet.socketSend(_sockindex, buf, min(bytesRemaining, (size_t) AT_CLIENT_SEND_MAX_SIZE) );
-    if ( ESP8266_AT_Drv::sendData(_sock, buf, min(bytesRemaining, (size_t) AT_CLIENT_SEND_MAX_SIZE) ) )
-    {
-      written =  min(bytesRemaining, (size_t) AT_CLIENT_SEND_MAX_SIZE);
-    }
-    else
-      written =  0;
+    setWriteError();
 
-    if (written > 0)
-    {
-      totalBytesSent += written;
+    return 0;
+  }
 
-      AT_LOGINFO3("ESP8266_AT_Client::write: written = ", written, ", totalBytesSent =", totalBytesSent);
+  // what was written before goes first
+  if (!sendTx())
+    return 0;
 
-      if (totalBytesSent >= size)
-      {
-        AT_LOGINFO3("ESP8266_AT_Client::write: Done, written = ", written, ", totalBytesSent =", totalBytesSent);
+  size_t   totalBytesSent = 0;
+  int      retry          = AT_CLIENT_MAX_WRITE_RETRY;
+  uint16_t backoff        = 0;
 
-        //completed successfully
-        retry = 0;
-      }
-      else
-      {
-        buf += written;
-        bytesRemaining -= written;
-        retry = AT_CLIENT_MAX_WRITE_RETRY;
+  // Fill each AT+CIPSEND, whatever the buffer boundaries
+  while (totalBytesSent < size)
+  {
+    uint16_t len = min(size - totalBytesSent, (size_t) _sliceSize);
 
-        AT_LOGINFO3("ESP8266_AT_Client::write: Partially Done, written = ", written, ", bytesRemaining =", bytesRemaining);
-      }
+    unsigned long start = millis();
+
+    if (ESP8266_AT_Drv::sendDataV(_sock, iov, count, totalBytesSent, len))
+    {
+      adaptSlice(len, millis() - start);
+
+      totalBytesSent += len;
+      retry           = AT_CLIENT_MAX_WRITE_RETRY;
+      backoff         = 0;
+
+      continue;
     }
-    else if (written < 0)
+
+    // Smaller slices get through a bad link more often
+    _sliceSize = max((uint16_t) (_sliceSize / 2), _sliceMin);
+
+    if (ESP8266_AT_Drv::lastSendResult() == AT_CMD_BUSY)
+      _sendStats.busy++;
+
+    if (--retry <= 0)
     {
-      AT_LOGINFO("ESP8266_AT_Client::write: written error");
+      AT_LOGINFO1(F("ESP8266_AT_Client::writev: error, bytesRemaining ="), size - totalBytesSent);
 
+      _sendStats.aborted++;
       setWriteError();
 
-      written = 0;
-      retry = 0;
+      break;
     }
 
-    // Looping
-  }
+    // give the module time to catch up before trying again
+    backoff = (backoff == 0) ? AT_CLIENT_BACKOFF_MIN : min((uint16_t) (backoff * 2), (uint16_t) AT_CLIENT_BACKOFF_MAX);
 
-  setWriteError();
+    AT_LOGDEBUG3(F("writev: retry in"), backoff, F("ms, slice ="), _sliceSize);
 
-  return 0;
+    _sendStats.retries++;
+    delay(backoff);
+  }
+
+  return totalBytesSent;
 }
 
 ////////////////////////////////////////
@@ -217,6 +303,9 @@ int ESP8266_AT_Client::available()
 {
   if (_sock != 255)
   {
+    // the answer may depend on what is still kept
+    sendTx();
+
     int bytes = ESP8266_AT_Drv::availData(_sock);
 
     if (bytes > 0)
@@ -242,6 +331,7 @@ int ESP8266_AT_Client::read()
 
   if (connClose)
   {
+    releaseTx(_sock);
     ESP8266_AT_Class::releaseSocket(_sock);
     _sock = 255;
   }
@@ -261,6 +351,79 @@ int ESP8266_AT_Client::read(uint8_t* buf, size_t size)
 
 ////////////////////////////////////////
 
+size_t ESP8266_AT_Client::readBytes(char *buffer, size_t length)
+{
+  return readSpan((uint8_t *) buffer, length, -1, NULL);
+}
+
+////////////////////////////////////////
+
+size_t ESP8266_AT_Client::readBytes(uint8_t *buffer, size_t length)
+{
+  return readSpan(buffer, length, -1, NULL);
+}
+
+////////////////////////////////////////
+
+size_t ESP8266_AT_Client::readBytesUntil(char terminator, char *buffer, size_t length)
+{
+  return readSpan((uint8_t *) buffer, length, (uint8_t) terminator, NULL);
+}
+
+////////////////////////////////////////
+
+size_t ESP8266_AT_Client::readBytesUntil(char terminator, uint8_t *buffer, size_t length)
+{
+  return readSpan(buffer, length, (uint8_t) terminator, NULL);
+}
+
+////////////////////////////////////////
+
+size_t ESP8266_AT_Client::readBytesUntil(char terminator, uint8_t *buffer, size_t length, bool* found)
+{
+  return readSpan(buffer, length, (uint8_t) terminator, found);
+}
+
+////////////////////////////////////////
+
+#define AT_CLIENT_READ_CHUNK_SIZE       64
+
+////////////////////////////////////////
+
+String ESP8266_AT_Client::readStringUntil(char terminator)
+{
+  String ret;
+  char chunk[AT_CLIENT_READ_CHUNK_SIZE];
+  bool found = false;
+
+  while (!found)
+  {
+    size_t len = readSpan((uint8_t *) chunk, sizeof(chunk) - 1, (uint8_t) terminator, &found);
+
+    if (len == 0 && !found)
+      break;
+
+    chunk[len] = 0;
+
+    // += of a C string stops at '\0', Stream's readStringUntil() keeps them
+    for (const char* pos = chunk; pos < chunk + len; )
+    {
+      ret += pos;
+      pos += strlen(pos);
+
+      if (pos < chunk + len)
+      {
+        ret += (char) 0;
+        pos++;
+      }
+    }
+  }
+
+  return ret;
+}
+
+////////////////////////////////////////
+
 int ESP8266_AT_Client::peek()
 {
   uint8_t b;
@@ -273,6 +436,7 @@ int ESP8266_AT_Client::peek()
 
   if (connClose)
   {
+    releaseTx(_sock);
     ESP8266_AT_Class::releaseSocket(_sock);
     _sock = 255;
   }
@@ -284,6 +448,14 @@ int ESP8266_AT_Client::peek()
 
 void ESP8266_AT_Client::flush()
 {
+  if ( (_sock < MAX_SOCK_NUM) && (_txLen[_sock] > 0) )
+  {
+    // the caller is about to wait for the answer, keep it
+    sendTx();
+
+    return;
+  }
+
   while (available())
     read();
 }
@@ -297,8 +469,11 @@ void ESP8266_AT_Client::stop()
 
   AT_LOGINFO1(F("Disconnecting "), _sock);
 
+  sendTx();
+
   ESP8266_AT_Drv::stopClient(_sock);
 
+  releaseTx(_sock);
   ESP8266_AT_Class::releaseSocket(_sock);
   _sock = 255;
 }
@@ -335,12 +510,14 @@ uint8_t ESP8266_AT_Client::status()
     return ESTABLISHED;
   }
 
-  if (ESP8266_AT_Drv::getClientState(_sock))
+  // No need to ask the module, it already said so
+  if (!ESP8266_AT_Drv::linkClosed(_sock) && ESP8266_AT_Drv::getClientState(_sock))
   {
     AT_LOGDEBUG(F("Client::status: getClientState OK"));
     return ESTABLISHED;
   }
 
+  releaseTx(_sock);
   ESP8266_AT_Class::releaseSocket(_sock);
   _sock = 255;
 
@@ -355,7 +532,7 @@ IPAddress ESP8266_AT_Client::remoteIP()
 {
   IPAddress ret;
 
-  ESP8266_AT_Drv::getRemoteIpAddress(ret);
+  ESP8266_AT_Drv::getRemoteIpAddress(_sock, ret);
 
   return ret;
 }
@@ -364,6 +541,48 @@ IPAddress ESP8266_AT_Client::remoteIP()
 // Private Methods
 ////////////////////////////////////////////////////////////////////////////////
 
+// Read up to length bytes, across +IPD packets, waiting up to the Stream timeout for more data.
+// If terminator >= 0, stop after it has been read. The terminator is not stored.
+size_t ESP8266_AT_Client::readSpan(uint8_t *buffer, size_t length, int terminator, bool* found)
+{
+  size_t count = 0;
+  bool hit = false;
+  unsigned long startMillis = millis();
+
+  while ( (count < length) && !hit )
+  {
+    if (!available())
+    {
+      if ( (_sock == 255) || (millis() - startMillis >= _timeout) )
+        break;
+
+      yield();
+      continue;
+    }
+
+    uint16_t size = min(length - count, (size_t) 0xFFFF);
+    int n;
+
+    if (terminator < 0)
+      n = ESP8266_AT_Drv::getDataBuf(_sock, buffer + count, size);
+    else
+      n = ESP8266_AT_Drv::getDataUntil(_sock, (char) terminator, buffer + count, size, &hit);
+
+    if (n < 0)
+      break;
+
+    count += n;
+    startMillis = millis();
+  }
+
+  if (found)
+    *found = hit;
+
+  return count;
+}
+
+////////////////////////////////////////
+
 size_t ESP8266_AT_Client::printFSH(const __FlashStringHelper *ifsh, bool appendCrLf)
 {
   size_t size = strlen_P((char*)ifsh);
@@ -374,7 +593,34 @@ size_t ESP8266_AT_Client::printFSH(const __FlashStringHelper *ifsh, bool appendC
     return 0;
   }
 
-  bool r = ESP8266_AT_Drv::sendData(_sock, ifsh, size, appendCrLf);
+  if (allocTx())
+  {
+    size_t size2 = size + 2 * appendCrLf;
+
+    if ( (_txLen[_sock] + size2 > _txCap[_sock]) && !sendTx() )
+      return 0;
+
+    if (size2 <= _txCap[_sock])
+    {
+      uint8_t* p = _txBuf[_sock] + _txLen[_sock];
+
+      memcpy_P(p, ifsh, size);
+
+      if (appendCrLf)
+      {
+        p[size]     = '\r';
+        p[size + 1] = '\n';
+      }
+
+      _txLen[_sock] += size2;
+
+      return size;
+    }
+  }
+
+  ATIoVec iov[2] = { { ifsh, size, true }, { "\r\n", 2, false } };
+
+  bool r = (writev(iov, appendCrLf ? 2 : 1) == size + 2 * appendCrLf);
 
   if (!r)
   {
@@ -391,4 +637,121 @@ size_t ESP8266_AT_Client::printFSH(const __FlashStringHelper *ifsh, bool appendC
 
 ////////////////////////////////////////
 
+// After a successful AT+CIPSEND of len bytes taking ms
+void ESP8266_AT_Client::adaptSlice(uint16_t len, unsigned long ms)
+{
+  _sendStats.slices++;
+  _sendStats.avgMillis = (_sendStats.avgMillis * 3 + min(ms, 0xFFFFUL)) / 4;
+
+  if (ms > AT_CLIENT_SLICE_SLOW_MS)
+  {
+    _sliceSize = max((uint16_t) (_sliceSize - _sliceSize / 4), _sliceMin);
+  }
+  else if (len == _sliceSize)
+  {
+    // only a full slice tells that the size is fine
+    _sliceSize = min((uint16_t) (_sliceSize + _sliceSize / 4 + 1), _sliceMax);
+  }
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Client::setSliceLimits(uint16_t minSize, uint16_t maxSize)
+{
+  _sliceMax = constrain(maxSize, (uint16_t) 1, (uint16_t) AT_SEND_MAX_SIZE);
+  _sliceMin = constrain(minSize, (uint16_t) 1, _sliceMax);
+
+  _sliceSize = constrain(_sliceSize, _sliceMin, _sliceMax);
+}
+
+////////////////////////////////////////
+
+uint16_t ESP8266_AT_Client::sliceSize()
+{
+  return _sliceSize;
+}
+
+////////////////////////////////////////
+
+const ATSendStats& ESP8266_AT_Client::sendStats()
+{
+  return _sendStats;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Client::resetSendStats()
+{
+  memset(&_sendStats, 0, sizeof(_sendStats));
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Client::setTxBuffer(uint16_t size)
+{
+  _txBufferSize = min(size, (uint16_t) AT_CLIENT_TX_BUFFER_MAX);
+
+  if ( (_sock < MAX_SOCK_NUM) && (_txCap[_sock] != _txBufferSize) )
+  {
+    sendTx();
+    releaseTx(_sock);
+  }
+}
+
+////////////////////////////////////////
+
+// true if the writes of the connected socket go to its buffer
+bool ESP8266_AT_Client::allocTx()
+{
+  if ( (_txBufferSize == 0) || (_sock >= MAX_SOCK_NUM) )
+    return false;
+
+  if (_txBuf[_sock] == NULL)
+  {
+    _txBuf[_sock] = new uint8_t[_txBufferSize];
+
+    if (_txBuf[_sock] == NULL)
+    {
+      AT_LOGERROR1(F("Can't allocate transmit buffer, Sz ="), _txBufferSize);
+      return false;
+    }
+
+    _txCap[_sock] = _txBufferSize;
+    _txLen[_sock] = 0;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Client::sendTx()
+{
+  if ( (_sock >= MAX_SOCK_NUM) || (_txLen[_sock] == 0) )
+    return true;
+
+  ATIoVec iov = { _txBuf[_sock], _txLen[_sock], false };
+
+  // emptied first, writev() sends what is kept before its own data
+  _txLen[_sock] = 0;
+
+  return (writev(&iov, 1) == iov.len);
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Client::releaseTx(uint8_t sock)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return;
+
+  delete[] _txBuf[sock];
+
+  _txBuf[sock] = NULL;
+  _txCap[sock] = 0;
+  _txLen[sock] = 0;
+}
+
+////////////////////////////////////////
+
 #endif    //ESP8266_AT_Client_impl_h
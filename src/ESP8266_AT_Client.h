@@ -32,6 +32,45 @@
 #include "Client.h"
 #include "IPAddress.h"
 
+#include "utility/ESP8266_AT_Drv.h"
+
+////////////////////////////////////////
+
+// Largest transmit buffer of setTxBuffer(), one TCP segment
+#ifndef AT_CLIENT_TX_BUFFER_MAX
+  #define AT_CLIENT_TX_BUFFER_MAX     1460
+#endif
+
+// Smallest AT+CIPSEND slice write() goes down to on a bad link
+#ifndef AT_CLIENT_SLICE_MIN
+  #define AT_CLIENT_SLICE_MIN         256
+#endif
+
+// ms above which an AT+CIPSEND is slow, and the next slices smaller
+#ifndef AT_CLIENT_SLICE_SLOW_MS
+  #define AT_CLIENT_SLICE_SLOW_MS     1000
+#endif
+
+// Consecutive failed AT+CIPSEND before write() gives up
+#ifndef AT_CLIENT_MAX_WRITE_RETRY
+  #define AT_CLIENT_MAX_WRITE_RETRY   10
+#endif
+
+// ms to wait after a failed AT+CIPSEND, doubled up to the max while it keeps failing
+#define AT_CLIENT_BACKOFF_MIN         20
+#define AT_CLIENT_BACKOFF_MAX         1000
+
+////////////////////////////////////////
+
+typedef struct
+{
+  uint32_t slices;      // AT+CIPSEND that succeeded
+  uint32_t retries;     // AT+CIPSEND tried again after a failure
+  uint32_t busy;        // failures because the module was busy
+  uint32_t aborted;     // writes given up after AT_CLIENT_MAX_WRITE_RETRY failures
+  uint16_t avgMillis;   // smoothed time of one AT+CIPSEND
+} ATSendStats;
+
 ////////////////////////////////////////
 
 class ESP8266_AT_Client : public Client
@@ -69,6 +108,16 @@ class ESP8266_AT_Client : public Client
     */
     int connectSSL(const char* host, uint16_t port);
 
+    /*
+      Connect in passthrough (transparent) mode, for bulk transfers: write() then streams the bytes at UART speed,
+      without AT+CIPSEND and SEND OK for each slice. The module must be in single connection mode for that,
+      so it fails if a server is running or another connection is open. No other AT command can be sent
+      until stop() leaves the mode with "+++".
+      Returns true if the connection succeeds, false if not.
+    */
+    int connectPassthrough(const char* host, uint16_t port);
+    int connectPassthrough(IPAddress ip, uint16_t port);
+
     /*
       Write a character to the server the client is connected to.
       Returns the number of characters written.
@@ -81,6 +130,30 @@ class ESP8266_AT_Client : public Client
     */
     virtual size_t write(const uint8_t *buf, size_t size);
 
+    /*
+      Write several buffers, in RAM or PROGMEM, in as few AT+CIPSEND as possible.
+      Returns the number of characters written.
+    */
+    size_t writev(const ATIoVec* iov, uint8_t count);
+
+    /*
+      Collect small writes in a buffer of size bytes, up to AT_CLIENT_TX_BUFFER_MAX, instead of sending each one
+      with its own AT+CIPSEND. The buffer is sent when full, by flush(), before any read and by stop().
+      0, the default, sends each write at once.
+    */
+    void setTxBuffer(uint16_t size);
+
+    /*
+      write() cuts the data in AT+CIPSEND slices, shrinking them on failures and slow sends, growing them back
+      on a good link, between minSize (default AT_CLIENT_SLICE_MIN) and maxSize (default AT_SEND_MAX_SIZE).
+      Shared by all the clients, as they share the module.
+    */
+    static void setSliceLimits(uint16_t minSize, uint16_t maxSize);
+    static uint16_t sliceSize();
+
+    static const ATSendStats& sendStats();
+    static void resetSendStats();
+
     virtual int available();
 
     /*
@@ -90,15 +163,37 @@ class ESP8266_AT_Client : public Client
     virtual int read();
 
 
+    /*
+      Read up to size bytes into buf, copying whole spans out of the serial buffer.
+      Returns the number of bytes read, or -1 if none is available.
+    */
     virtual int read(uint8_t *buf, size_t size);
 
+    /*
+      Bulk versions of the Stream helpers, they wait up to the Stream timeout for data like the originals
+      but copy whole spans instead of calling read() for every byte.
+    */
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length);
+
+    size_t readBytesUntil(char terminator, char *buffer, size_t length);
+    size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length);
+
+    /*
+      Same as readBytesUntil, found is set to true if the (consumed) terminator was reached
+    */
+    size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length, bool* found);
+
+    String readStringUntil(char terminator);
+
     /*
       Returns the next byte (character) of incoming serial data without removing it from the internal serial buffer.
     */
     virtual int peek();
 
     /*
-      Discard any bytes that have been written to the client but not yet read.
+      Send the bytes kept by setTxBuffer().
+      If there were none, discard any bytes that have been written to the client but not yet read.
     */
     virtual void flush();
 
@@ -136,8 +231,29 @@ class ESP8266_AT_Client : public Client
 
     uint8_t _sock;     // connection id
 
+    uint16_t _txBufferSize;   // wanted by setTxBuffer()
+
+    // transmit buffers, per socket so that copies of the client share them
+    static uint8_t*   _txBuf[MAX_SOCK_NUM];
+    static uint16_t   _txCap[MAX_SOCK_NUM];
+    static uint16_t   _txLen[MAX_SOCK_NUM];
+
+    // adaptive AT+CIPSEND size
+    static uint16_t     _sliceSize;
+    static uint16_t     _sliceMin;
+    static uint16_t     _sliceMax;
+    static ATSendStats  _sendStats;
+
+    static void adaptSlice(uint16_t len, unsigned long ms);
+
+    bool allocTx();
+    bool sendTx();
+    static void releaseTx(uint8_t sock);
+
     int connect(const char* host, uint16_t port, uint8_t protMode);
 
+    size_t readSpan(uint8_t *buffer, size_t length, int terminator, bool* found);
+
     size_t printFSH(const __FlashStringHelper *ifsh, bool appendCrLf);
 };
 
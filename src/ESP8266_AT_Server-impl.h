@@ -59,6 +59,9 @@ void ESP8266_AT_Server::begin()
 
   ESP8266_AT_Class::allocateSocket(_sock);
 
+  // Incoming connections may get this link id too, they are ours
+  ESP8266_AT_Class::_server_port[_sock] = _port;
+
   _started = ESP8266_AT_Drv::startServer(_port, _sock);
 
   if (_started)
@@ -86,15 +89,12 @@ ESP8266_AT_Client ESP8266_AT_Server::available(byte* status)
   // TODO the original method seems to handle automatic server restart
   ESP_AT_UNUSED(status);
 
-  int bytes = ESP8266_AT_Drv::availData(0);
-
-  if (bytes > 0)
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
   {
-    AT_LOGINFO1(F("New client"), ESP8266_AT_Drv::_connId);
-    ESP8266_AT_Class::allocateSocket(ESP8266_AT_Drv::_connId);
-    ESP8266_AT_Client client(ESP8266_AT_Drv::_connId);
+    ESP8266_AT_Client client = accept(sock);
 
-    return client;
+    if (client)
+      return client;
   }
 
   return ESP8266_AT_Client(255);
@@ -102,6 +102,24 @@ ESP8266_AT_Client ESP8266_AT_Server::available(byte* status)
 
 ////////////////////////////////////////
 
+ESP8266_AT_Client ESP8266_AT_Server::accept(uint8_t sock)
+{
+  if ( (sock >= MAX_SOCK_NUM) || (ESP8266_AT_Drv::availData(sock) == 0) )
+    return ESP8266_AT_Client(255);
+
+  // Skip the sockets of outgoing clients, UDP and other servers
+  if ( (ESP8266_AT_Class::_state[sock] != NA_STATE) && (ESP8266_AT_Class::_server_port[sock] != _port) )
+    return ESP8266_AT_Client(255);
+
+  AT_LOGINFO1(F("New client"), sock);
+  ESP8266_AT_Class::allocateSocket(sock);
+  ESP8266_AT_Class::_server_port[sock] = _port;
+
+  return ESP8266_AT_Client(sock);
+}
+
+////////////////////////////////////////
+
 uint8_t ESP8266_AT_Server::status()
 {
   return ESP8266_AT_Drv::getServerState(0);
@@ -47,6 +47,12 @@ class ESP8266_AT_Server : public Server
     */
     ESP8266_AT_Client available(uint8_t* status = NULL);
 
+    /*
+      Same as available(), for link id sock only: servers that keep several connections
+      use it to pick up each of them once.
+    */
+    ESP8266_AT_Client accept(uint8_t sock);
+
     /*
       Start the TCP server
     */
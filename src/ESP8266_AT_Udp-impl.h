@@ -240,6 +240,11 @@ int ESP8266_AT_UDP::peek()
   if (!available())
     return -1;
 
+  bool connClose = false;
+
+  if (! ESP8266_AT_Drv::getData(_sock, &b, true, &connClose))
+    return -1;
+
   return b;
 }
 
@@ -259,14 +264,14 @@ void ESP8266_AT_UDP::flush()
 IPAddress  ESP8266_AT_UDP::remoteIP()
 {
   IPAddress ret;
-  ESP8266_AT_Drv::getRemoteIpAddress(ret);
+  ESP8266_AT_Drv::getRemoteIpAddress(_sock, ret);
 
   return ret;
 }
 
 uint16_t  ESP8266_AT_UDP::remotePort()
 {
-  return ESP8266_AT_Drv::getRemotePort();
+  return ESP8266_AT_Drv::getRemotePort(_sock);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
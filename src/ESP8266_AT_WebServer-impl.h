@@ -49,11 +49,22 @@ ESP8266_AT_WebServer::ESP8266_AT_WebServer(int port)
   , _lastHandler(0)
   , _currentArgCount(0)
   , _currentArgs(0)
+  , _queryArgCount(0)
   , _headerKeysCount(0)
   , _currentHeaders(0)
   , _contentLength(0)
+  , _responseHeadersLength(0)
+  , _responseHeadersTail(0)
   , _chunked(false)
+  , _keepAlive(false)
+  , _keepAliveSent(false)
+  , _currentConn(nullptr)
+  , _nextConn(0)
 {
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+    _conn[sock].status = HC_NONE;
+
+  memset(_etags, 0, sizeof(_etags));
 }
 
 ////////////////////////////////////////
@@ -73,6 +84,12 @@ ESP8266_AT_WebServer::~ESP8266_AT_WebServer()
     handler = next;
   }
 
+  if (_routes)
+    delete[] _routes;
+
+  if (_cachePool)
+    delete[] _cachePool;
+
   close();
 }
 
@@ -161,7 +178,27 @@ void ESP8266_AT_WebServer::on(const String &uri, HTTPMethod method, ESP8266_AT_W
 void ESP8266_AT_WebServer::on(const String &uri, HTTPMethod method, ESP8266_AT_WebServer::THandlerFunction fn,
                               ESP8266_AT_WebServer::THandlerFunction ufn)
 {
-  _addRequestHandler(new FunctionRequestHandler(fn, ufn, uri, method));
+  FunctionRequestHandler* handler = new FunctionRequestHandler(fn, ufn, uri, method);
+
+  // The route index points to the handler's copy of uri
+  _addRequestHandler(handler, &handler->uri(), method);
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::onAsset_P(const String& uri, PGM_P contentType, PGM_P gzipped, size_t gzippedLength,
+                                     PGM_P plain, size_t plainLength)
+{
+  AssetRequestHandler* handler = new AssetRequestHandler(uri, contentType, gzipped, gzippedLength, plain, plainLength);
+
+  _addRequestHandler(handler, &handler->uri(), HTTP_GET);
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::serveStatic(const char* uri, ATFileSystem& fs, const char* path, const char* cache_header)
+{
+  _addRequestHandler(new StaticRequestHandler(fs, path, uri, cache_header));
 }
 
 ////////////////////////////////////////
@@ -173,7 +210,14 @@ void ESP8266_AT_WebServer::addHandler(RequestHandler* handler)
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::_addRequestHandler(RequestHandler* handler)
+void ESP8266_AT_WebServer::on(const ATRoute* routes, size_t count)
+{
+  _addRequestHandler(new RouteTableRequestHandler(routes, count), NULL, HTTP_ANY, true);
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::_addRequestHandler(RequestHandler* handler, const String* uri, HTTPMethod method, bool table)
 {
   if (!_lastHandler)
   {
@@ -185,99 +229,775 @@ void ESP8266_AT_WebServer::_addRequestHandler(RequestHandler* handler)
     _lastHandler->next(handler);
     _lastHandler = handler;
   }
+
+  if (_routeCount == _routeCapacity)
+  {
+    uint16_t capacity   = _routeCapacity ? 2 * _routeCapacity : 8;
+    RouteEntry* routes  = new RouteEntry[capacity];
+
+    if (!routes)
+    {
+      AT_LOGERROR(F("_addRequestHandler: No memory for route"));
+      return;
+    }
+
+    if (_routes)
+    {
+      memcpy(routes, _routes, _routeCount * sizeof(RouteEntry));
+      delete[] _routes;
+    }
+
+    _routes        = routes;
+    _routeCapacity = capacity;
+  }
+
+  RouteEntry route;
+
+  route.uri     = uri ? uri->c_str() : NULL;
+  route.length  = table ? RouteEntry::TABLE : 0;
+  route.method  = method;
+  route.handler = handler;
+  route.order   = _routeCount;
+
+  uint16_t pos = _routeCount;
+
+  if (uri && ( strchr(route.uri, URI_PATTERN_SEGMENT) || strchr(route.uri, URI_PATTERN_REST) ))
+  {
+    route.length = RouteEntry::PATTERN;
+  }
+  else if (uri && uri->endsWith("/*"))
+  {
+    route.length = uri->length() - 2;
+  }
+  else if (uri)
+  {
+    // Sorted insert, after the same uris registered before
+    pos = 0;
+
+    while ( (pos < _routeExact) && (strcmp(_routes[pos].uri, route.uri) <= 0) )
+      pos++;
+
+    memmove(&_routes[pos + 1], &_routes[pos], (_routeCount - pos) * sizeof(RouteEntry));
+    _routeExact++;
+  }
+
+  _routes[pos] = route;
+  _routeCount++;
 }
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::handleClient()
+// The handler the linked list would find first, without calling canHandle() on every on() route
+RequestHandler* ESP8266_AT_WebServer::_findHandler(HTTPMethod method, const String& uri)
 {
-  if (_currentStatus == HC_NONE)
+  const RouteEntry* found = NULL;
+  uint16_t low  = 0;
+  uint16_t high = _routeExact;
+
+  _pathArgCount = 0;
+
+  while (low < high)
   {
-    ESP8266_AT_Client client = _server.available();
+    uint16_t mid = (low + high) / 2;
 
-    if (!client)
+    if (strcmp(_routes[mid].uri, uri.c_str()) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  for ( ; (low < _routeExact) && !strcmp(_routes[low].uri, uri.c_str()); low++)
+  {
+    if ( (_routes[low].method == HTTP_ANY) || (_routes[low].method == method) )
     {
-      return;
+      found = &_routes[low];
+      break;
+    }
+  }
+
+  // Those registered before the exact match still come first
+  for (uint16_t i = _routeExact; i < _routeCount; i++)
+  {
+    const RouteEntry& route = _routes[i];
+
+    if (found && (route.order > found->order))
+      break;
+
+    if (route.uri)
+    {
+      if ( (route.method != HTTP_ANY) && (route.method != method) )
+        continue;
+
+      if (route.length == RouteEntry::PATTERN)
+      {
+        int count = matchUriPattern(route.uri, uri.c_str(), _pathArgs, HTTP_MAX_PATH_ARGS);
+
+        if (count >= 0)
+        {
+          _pathArgCount = min(count, HTTP_MAX_PATH_ARGS);
+
+          return route.handler;
+        }
+      }
+      else if (!strncmp(route.uri, uri.c_str(), route.length))
+      {
+        return route.handler;
+      }
     }
+    else if (route.length == RouteEntry::TABLE)
+    {
+      int count;
 
-    AT_LOGDEBUG(F("handleClient: New Client"));
+      if (((RouteTableRequestHandler*) route.handler)->find(method, uri.c_str(), _pathArgs, HTTP_MAX_PATH_ARGS, &count) >= 0)
+      {
+        _pathArgCount = min(count, HTTP_MAX_PATH_ARGS);
 
-    _currentClient = client;
-    _currentStatus = HC_WAIT_READ;
-    _statusChange = millis();
+        return route.handler;
+      }
+    }
+    else if (route.handler->canHandle(method, uri))
+    {
+      return route.handler;
+    }
   }
 
-  bool keepCurrentClient = false;
+  return found ? found->handler : NULL;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::handleClient()
+{
+  // Keep queued AT commands moving, even while serving a client
+  ESP8266_AT_Class::poll();
+
+  int  readySock = -1;
   bool callYield = false;
 
-  if (_currentClient.connected() || _currentClient.available())
+  // One context per link id, each with its own request head parser, so a slow client
+  // no longer holds up the others. Round robin, starting after the last one served.
+  for (uint8_t i = 0; i < MAX_SOCK_NUM; i++)
   {
-    switch (_currentStatus)
+    uint8_t sock = (_nextConn + i) % MAX_SOCK_NUM;
+    HTTPConnection& conn = _conn[sock];
+
+    if (conn.status == HC_NONE)
     {
-      case HC_NONE:
-        // No-op to avoid C++ compiler warning
+      if (!_server.accept(sock))
+        continue;
+
+      AT_LOGDEBUG1(F("handleClient: New Client"), sock);
+
+      conn.status   = HC_WAIT_READ;
+      conn.requests = 0;
+      _resetHead(sock);
+    }
+
+    bool idle = (conn.parse == HP_METHOD) && (conn.len == 0);
+
+    if (_readHead(sock))
+    {
+      if (readySock < 0)
+        readySock = sock;
+    }
+    else if ( ESP8266_AT_Drv::linkClosed(sock)
+              || (millis() - conn.statusChange > ( (idle && conn.requests) ? HTTP_KEEP_ALIVE_TIMEOUT : HTTP_MAX_DATA_WAIT)) )
+    {
+      AT_LOGDEBUG1(F("handleClient: Drop client"), sock);
+      _closeConnection(sock);
+    }
+    else
+    {
+      callYield = true;
+    }
+  }
+
+  if (readySock >= 0)
+  {
+    HTTPConnection& conn = _conn[readySock];
+
+    _nextConn = readySock + 1;
+
+    _currentConn   = &conn;
+    _currentClient = ESP8266_AT_Client(readySock);
+    _keepAliveSent = false;
+    _responseHeadersLength = 0;
+
+    if (conn.parse != HP_DONE)
+    {
+      // What is left of the request can't be read, answer and close
+      _currentVersion = conn.version;
+      _keepAlive      = false;
+      _contentLength  = CONTENT_LENGTH_NOT_SET;
+
+      send( (conn.parse == HP_URI_TOO_LONG) ? 414 : 431 );
+    }
+    else if (_parseRequest(_currentClient))
+    {
+      // Busy servers close idle connections first, then stop keeping links their new clients would need
+      if (_freeLinks() < HTTP_KEEP_ALIVE_RESERVE)
+        _reclaimLink();
+
+      if ( (conn.requests + 1 >= HTTP_KEEP_ALIVE_MAX) || (_freeLinks() < HTTP_KEEP_ALIVE_RESERVE) )
+        _keepAlive = false;
+
+      _currentClient.setTimeout(HTTP_MAX_SEND_WAIT);
+      _contentLength = CONTENT_LENGTH_NOT_SET;
+
+      if (!_cacheServe())
+        _handleRequest();
+    }
+
+    if (_keepAliveSent && !ESP8266_AT_Drv::linkClosed(readySock))
+    {
+      // Wait for the next request on the same link, anything already queued belongs to it
+      conn.requests++;
+      _resetHead(readySock);
+
+      AT_LOGDEBUG1(F("handleClient: Keep alive, requests ="), conn.requests);
+    }
+    else
+    {
+      // KH, fix bug. Have to close the connection.
+      _closeConnection(readySock);
+
+      AT_LOGINFO(F("handleClient: Client disconnected"));
+    }
+
+    _currentConn   = nullptr;
+    _currentQuery  = nullptr;
+    _queryArgCount = 0;
+    _currentClient = ESP8266_AT_Client();
+  }
+  else if (callYield)
+  {
+    yield();
+  }
+
+  if (_freeLinks() < HTTP_KEEP_ALIVE_RESERVE)
+    _reclaimLink();
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::_resetHead(uint8_t sock)
+{
+  HTTPConnection& conn = _conn[sock];
+
+  conn.statusChange = millis();
+  conn.parse        = HP_METHOD;
+  conn.version      = 0;
+  conn.len          = 0;
+  conn.line         = 0;
+  conn.uri          = 0;
+  conn.headers      = 0;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_WebServer::_headPut(HTTPConnection& conn, char c, uint8_t tooLarge)
+{
+  if (conn.len >= HTTP_HEAD_BUFFER_SIZE)
+  {
+    conn.parse = tooLarge;
+
+    return false;
+  }
+
+  conn.head[conn.len++] = c;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+/*
+   Feed the request head of sock to its parser, as far as it was received. Byte by byte out of
+   the socket queue, so that the body stays there for _parseRequest(). Only the request line and
+   the headers _wantHeader() asks for are kept: "method\0uri\0" then "name\0value\0" pairs.
+   A 431 only comes from a wanted header which doesn't fit, the others are skipped whatever their length.
+   Returns true once the head is complete, or can't be: see conn.parse.
+*/
+bool ESP8266_AT_WebServer::_readHead(uint8_t sock)
+{
+  HTTPConnection& conn = _conn[sock];
+
+  if (conn.parse >= HP_DONE)
+    return true;
+
+  ESP8266_AT_Drv::availData(sock);
+
+  uint8_t c;
+  bool    connClose;
+
+  while ( (conn.parse < HP_DONE) && (ESP8266_AT_Drv::peekData(sock, 0) >= 0) )
+  {
+    ESP8266_AT_Drv::getData(sock, &c, false, &connClose);
+
+    switch (conn.parse)
+    {
+      case HP_METHOD:
+
+        // Empty lines before the request line are allowed
+        if ( (c == '\r') || (c == '\n') )
+          break;
+
+        if (c != ' ')
+        {
+          _headPut(conn, c, HP_URI_TOO_LONG);
+        }
+        else if (_headPut(conn, 0, HP_URI_TOO_LONG))
+        {
+          conn.uri   = conn.len;
+          conn.parse = HP_URI;
+        }
+
+        break;
+
+      case HP_URI:
+
+        if ( (c != ' ') && (c != '\r') && (c != '\n') )
+        {
+          _headPut(conn, c, HP_URI_TOO_LONG);
+        }
+        else if (_headPut(conn, 0, HP_URI_TOO_LONG))
+        {
+          conn.line    = conn.len;
+          conn.headers = conn.len;
+          conn.parse   = (c == '\n') ? HP_NAME : HP_VERSION;
+        }
+
+        break;
+
+      case HP_VERSION:
+
+        // "HTTP/1.x"
+        if ( (c >= '0') && (c <= '9') )
+          conn.version = c - '0';
+        else if (c == '\n')
+          conn.parse = HP_NAME;
+
         break;
 
-      case HC_WAIT_READ:
+      case HP_NAME:
+
+        if (c == '\r')
+          break;
 
-        // Wait for data from client to become available
-        if (_currentClient.available())
+        if (c == '\n')
         {
-          if (_parseRequest(_currentClient))
+          if (conn.len == conn.line)
+            conn.parse = HP_DONE;
+          else
+            conn.len = conn.line;     // No ':', ignore the line
+
+          break;
+        }
+
+        if (c != ':')
+        {
+          // Leaving room for its '\0'
+          if (conn.len < HTTP_HEAD_BUFFER_SIZE - 1)
           {
-            _currentClient.setTimeout(HTTP_MAX_SEND_WAIT);
-            _contentLength = CONTENT_LENGTH_NOT_SET;
-            _handleRequest();
+            conn.head[conn.len++] = c;
+
+            break;
+          }
+
+          // Too long to keep, skip it unless it may be a wanted one
+          char first[2] = { (char) c, 0 };
+
+          conn.head[conn.len] = 0;
+
+          if (_wantHeader( (conn.len > conn.line) ? &conn.head[conn.line] : first, true ))
+          {
+            conn.parse = HP_HEADERS_TOO_LARGE;
+          }
+          else
+          {
+            conn.len   = conn.line;
+            conn.parse = HP_SKIP;
           }
         }
-        else
+        else if (_headPut(conn, 0, HP_HEADERS_TOO_LARGE))
         {
-          if (millis() - _statusChange <= HTTP_MAX_DATA_WAIT)
+          if (_wantHeader(&conn.head[conn.line]))
+          {
+            conn.parse = HP_VALUE_LEAD;
+          }
+          else
           {
-            keepCurrentClient = true;
+            conn.len   = conn.line;
+            conn.parse = HP_SKIP;
           }
+        }
+
+        break;
+
+      case HP_VALUE_LEAD:
 
-          callYield = true;
+        if ( (c == ' ') || (c == '\t') )
+          break;
+
+        conn.parse = HP_VALUE;
+
+      // fall through
+      case HP_VALUE:
+
+        if (c == '\r')
+          break;
+
+        if (c != '\n')
+        {
+          _headPut(conn, c, HP_HEADERS_TOO_LARGE);
+
+          break;
+        }
+
+        while (conn.head[conn.len - 1] == ' ')
+          conn.len--;
+
+        if (_headPut(conn, 0, HP_HEADERS_TOO_LARGE))
+        {
+          conn.line  = conn.len;
+          conn.parse = HP_NAME;
         }
 
         break;
 
-      case HC_WAIT_CLOSE:
+      case HP_SKIP:
+
+        if (c == '\n')
+          conn.parse = HP_NAME;
+
+        break;
+    }
+  }
+
+  return conn.parse >= HP_DONE;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::_closeConnection(uint8_t sock)
+{
+  ESP8266_AT_Client(sock).stop();
+
+  _conn[sock].status = HC_NONE;
+}
+
+////////////////////////////////////////
+
+uint8_t ESP8266_AT_WebServer::_freeLinks()
+{
+  uint8_t count = 0;
+
+  // Links neither serving a connection, nor used by an outgoing client or UDP
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+  {
+    if ( (_conn[sock].status == HC_NONE)
+         && ( (ESP8266_AT_Class::_state[sock] == NA_STATE) || (ESP8266_AT_Class::_server_port[sock] != 0) ) )
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::_reclaimLink()
+{
+  int oldest = -1;
+
+  // Close the persistent connection idle for the longest time
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+  {
+    const HTTPConnection& conn = _conn[sock];
+
+    if ( (conn.status == HC_NONE) || (conn.requests == 0) || (conn.parse != HP_METHOD) || (conn.len != 0) )
+      continue;
+
+    if ( (oldest < 0) || (millis() - conn.statusChange > millis() - _conn[oldest].statusChange) )
+      oldest = sock;
+  }
+
+  if (oldest >= 0)
+  {
+    AT_LOGDEBUG1(F("handleClient: Reclaim idle link"), oldest);
+    _closeConnection(oldest);
+  }
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_WebServer::cache(const String& uri, unsigned long ttl, bool withQuery)
+{
+  uint8_t route = 0;
+
+  while ( (route < _cacheRouteCount) && !(_cacheRoutes[route].uri == uri) )
+    route++;
+
+  if (route == HTTP_CACHE_MAX_ROUTES)
+  {
+    AT_LOGERROR1(F("cache: No room for"), uri);
+    return false;
+  }
+
+  if (!_cachePool)
+  {
+    _cachePool = new char[HTTP_CACHE_SIZE];
+
+    if (!_cachePool)
+    {
+      AT_LOGERROR(F("cache: No memory for the pool"));
+      return false;
+    }
+  }
+
+  if (route == _cacheRouteCount)
+  {
+    _cacheRoutes[route].uri = uri;
+    _cacheRouteCount++;
+  }
+  else
+  {
+    invalidate(uri);
+  }
+
+  _cacheRoutes[route].ttl       = ttl;
+  _cacheRoutes[route].withQuery = withQuery;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::invalidate(const String& uri)
+{
+  for (uint8_t entry = _cacheEntryCount; entry-- > 0; )
+  {
+    if (_cacheRoutes[_cacheEntries[entry].route].uri == uri)
+      _cacheRemove(entry);
+  }
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::invalidate()
+{
+  _cacheEntryCount = 0;
+  _cacheUsed       = 0;
+  _cacheStored     = -1;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::_cacheRemove(uint8_t entry)
+{
+  CacheEntry& removed = _cacheEntries[entry];
+  uint16_t length     = removed.keyLength + removed.headLength + removed.bodyLength;
+  uint16_t end        = removed.offset + length;
+
+  memmove(&_cachePool[removed.offset], &_cachePool[end], _cacheUsed - end);
+  _cacheUsed -= length;
+
+  for (uint8_t i = entry + 1; i < _cacheEntryCount; i++)
+  {
+    _cacheEntries[i - 1] = _cacheEntries[i];
+    _cacheEntries[i - 1].offset -= length;
+  }
+
+  _cacheEntryCount--;
+
+  if (_cacheStored == entry)
+    _cacheStored = -1;
+  else if (_cacheStored > entry)
+    _cacheStored--;
+}
+
+////////////////////////////////////////
+
+// Key length of the current request, with the query it uses, if any
+size_t ESP8266_AT_WebServer::_cacheKeyLength(const char** query)
+{
+  *query = NULL;
+
+  if (_cacheRoutes[_cacheRoute].withQuery && _currentQuery && *_currentQuery)
+    *query = _currentQuery;
+
+  return _currentUri.length() + (*query ? 1 + strlen(*query) : 0);
+}
+
+////////////////////////////////////////
+
+int8_t ESP8266_AT_WebServer::_cacheFind()
+{
+  const char* query;
+  size_t keyLength   = _cacheKeyLength(&query);
+  size_t pathLength  = _currentUri.length();
+
+  for (uint8_t entry = 0; entry < _cacheEntryCount; entry++)
+  {
+    const CacheEntry& e = _cacheEntries[entry];
+    const char* key     = &_cachePool[e.offset];
+
+    if ( (e.route == _cacheRoute) && (e.keyLength == keyLength) && !memcmp(key, _currentUri.c_str(), pathLength)
+         && (!query || !memcmp(key + pathLength + 1, query, keyLength - pathLength - 1)) )
+    {
+      return entry;
+    }
+  }
+
+  return -1;
+}
+
+////////////////////////////////////////
+
+/*
+  Send the kept response to a GET of a cache() uri, true if there was one.
+  Otherwise the response the handler is about to send is kept by _cacheStore().
+*/
+bool ESP8266_AT_WebServer::_cacheServe()
+{
+  _cacheRoute  = -1;
+  _cacheStored = -1;
+
+  if (!_cachePool || (_currentMethod != HTTP_GET))
+    return false;
+
+  for (uint8_t route = 0; route < _cacheRouteCount; route++)
+  {
+    if (_cacheRoutes[route].uri == _currentUri)
+    {
+      _cacheRoute = route;
+      break;
+    }
+  }
+
+  if (_cacheRoute < 0)
+    return false;
+
+  // Expired entries make room for new ones
+  for (uint8_t entry = _cacheEntryCount; entry-- > 0; )
+  {
+    if (millis() - _cacheEntries[entry].stored >= _cacheRoutes[_cacheEntries[entry].route].ttl)
+      _cacheRemove(entry);
+  }
+
+  int8_t entry = _cacheFind();
+
+  if (entry < 0)
+  {
+    _cacheMisses++;
+    return false;
+  }
+
+  _cacheHits++;
+
+  const CacheEntry& e = _cacheEntries[entry];
+  char* head          = &_cachePool[e.offset + e.keyLength];
+
+  AT_LOGDEBUG1(F("_cacheServe: hit "), _currentUri);
+
+  // The version of the status line and the Connection header are those of this request
+  head[7] = '0' + _currentVersion;
+
+  _keepAliveSent = _keepAlive;
+
+  const char* connection = _keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+  ATIoVec parts[3] =
+  {
+    { head,                 e.headLength,       false },
+    { connection,           strlen(connection), false },
+    { head + e.headLength,  e.bodyLength,       false }
+  };
+
+  _currentClient.writev(parts, e.bodyLength ? 3 : 2);
+
+  _cacheRoute = -1;
+  _currentUri = "";
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// Keep the response being sent, if it is sent all at once
+void ESP8266_AT_WebServer::_cacheStore(const char* header, size_t headerLength, const char* content, size_t size,
+                                       bool progmem)
+{
+  if (!header || (_cacheStored >= 0))
+  {
+    // More content than the header announced, what was kept is incomplete
+    if (_cacheStored >= 0)
+      _cacheRemove(_cacheStored);
 
-        // Wait for client to close the connection
-        if (millis() - _statusChange <= HTTP_MAX_CLOSE_WAIT)
-        {
-          keepCurrentClient = true;
-          callYield = true;
-        }
-    }
+    _cacheRoute = -1;
+    return;
   }
 
-  if (!keepCurrentClient)
+  const char* query;
+  size_t keyLength  = _cacheKeyLength(&query);
+  size_t pathLength = _currentUri.length();
+  size_t headLength = headerLength - _responseHeadersTail;
+  size_t bodyLength = content ? size : 0;
+  size_t length     = keyLength + headLength + bodyLength;
+
+  if (length > HTTP_CACHE_SIZE)
   {
-    AT_LOGDEBUG(F("handleClient: Don't keepCurrentClient"));
-    _currentClient = ESP8266_AT_Client();
-    _currentStatus = HC_NONE;
-    // KH
-    //_currentUpload.reset();
+    AT_LOGDEBUG1(F("_cacheStore: Too large to keep, len = "), length);
+    return;
   }
 
-  if (callYield)
+  // The oldest entries are the first ones
+  while ( (_cacheEntryCount == HTTP_CACHE_MAX_ENTRIES) || (_cacheUsed + length > HTTP_CACHE_SIZE) )
+    _cacheRemove(0);
+
+  CacheEntry& e = _cacheEntries[_cacheEntryCount];
+
+  e.offset      = _cacheUsed;
+  e.keyLength   = keyLength;
+  e.headLength  = headLength;
+  e.bodyLength  = bodyLength;
+  e.route       = _cacheRoute;
+  e.stored      = millis();
+
+  char* p = &_cachePool[_cacheUsed];
+
+  memcpy(p, _currentUri.c_str(), pathLength);
+  p += pathLength;
+
+  if (query)
   {
-    yield();
+    *p++ = '?';
+    memcpy(p, query, keyLength - pathLength - 1);
+    p += keyLength - pathLength - 1;
   }
 
-  // KH, fix bug. Have to close the connection.
-  _currentClient.stop();
-  AT_LOGINFO(F("handleClient: Client disconnected"));
+  memcpy(p, header, headLength);
+  p += headLength;
+
+  if (progmem)
+    memcpy_P(p, content, bodyLength);
+  else if (bodyLength)
+    memcpy(p, content, bodyLength);
+
+  _cacheUsed   += length;
+  _cacheStored = _cacheEntryCount++;
 }
 
 ////////////////////////////////////////
 
 void ESP8266_AT_WebServer::close()
 {
-  // TODO: Write close method for ESP8266_AT library and uncomment this
-  _currentStatus = HC_NONE;
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+  {
+    if (_conn[sock].status != HC_NONE)
+      _closeConnection(sock);
+  }
 
   if (!_headerKeysCount)
     collectHeaders(0, 0);
@@ -292,178 +1012,227 @@ void ESP8266_AT_WebServer::stop()
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::sendHeader(const String& name, const String& value, bool first)
+/*
+  Response headers are built in place in _responseHeaders: sendHeader() lines first, then those
+  of _prepareHeader(), which puts the status line and Content-Type in front of them.
+  Returns where a header line of length bytes goes at pos, or NULL if it would pass limit.
+*/
+char* ESP8266_AT_WebServer::_headerSpace(uint16_t pos, size_t length, size_t limit)
 {
-  EWString headerLine = fromString(name);
-
-  headerLine += ": ";
-  headerLine += fromString(value);
-  headerLine += RETURN_NEWLINE;
-
-  if (first)
+  if (_responseHeadersLength + length > limit)
   {
-    _responseHeaders = fromEWString(headerLine + fromString(_responseHeaders));
+    AT_LOGERROR(F("Response header dropped, no room left"));
+    return NULL;
   }
+
+  memmove(&_responseHeaders[pos + length], &_responseHeaders[pos], _responseHeadersLength - pos);
+  _responseHeadersLength += length;
+
+  return &_responseHeaders[pos];
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_WebServer::_headerLine(uint16_t pos, const char* name, bool progmem, const char* value, size_t limit)
+{
+  size_t nameLength  = progmem ? strlen_P(name) : strlen(name);
+  size_t valueLength = strlen(value);
+
+  char* line = _headerSpace(pos, nameLength + valueLength + 4, limit);
+
+  if (!line)
+    return false;
+
+  if (progmem)
+    memcpy_P(line, name, nameLength);
   else
-  {
-    _responseHeaders = fromEWString(fromString(_responseHeaders) + headerLine);
-  }
+    memcpy(line, name, nameLength);
+
+  line += nameLength;
+  *line++ = ':';
+  *line++ = ' ';
+
+  memcpy(line, value, valueLength);
+  line += valueLength;
+
+  *line++ = '\r';
+  *line   = '\n';
+
+  return true;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_WebServer::sendHeader(const String& name, const String& value, bool first)
+{
+  // Leave room for the headers of _prepareHeader()
+  return _headerLine(first ? 0 : _responseHeadersLength, name.c_str(), false, value.c_str(),
+              HTTP_HEADER_BUFFER_SIZE - HTTP_HEADER_RESERVE);
 }
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::setContentLength(size_t contentLength)
+void ESP8266_AT_WebServer::setContentLength(uint32_t contentLength)
 {
   _contentLength = contentLength;
 }
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::_prepareHeader(String& response, int code, const char* content_type, size_t contentLength)
+// Decimal digits of value into buffer, '\0' terminated, returns the end
+static char* formatNumber(char* buffer, uint32_t value)
 {
-  EWString aResponse = fromString(response);
+  char digits[20];
+  uint8_t count = 0;
+
+  do
+  {
+    digits[count++] = '0' + (value % 10);
+    value /= 10;
+  } while (value);
+
+  while (count)
+    *buffer++ = digits[--count];
 
-  aResponse = "HTTP/1." + fromString(String(_currentVersion)) + " ";
-  aResponse += fromString(String(code));
-  aResponse += " ";
-  aResponse += fromString(_responseCodeToString(code));
-  aResponse += RETURN_NEWLINE;
+  *buffer = 0;
+
+  return buffer;
+}
+
+////////////////////////////////////////
 
+/*
+  Complete the response header in _responseHeaders, returns its length.
+  It stays there until the next sendHeader(), which starts the header of the next response.
+  The lines a response can't do without take their room first, so that a full buffer only loses optional ones.
+*/
+size_t ESP8266_AT_WebServer::_prepareHeader(int code, const char* content_type, size_t contentLength)
+{
   using namespace mime;
 
-  if (!content_type)
-    content_type = mimeTable[html].mimeType;
+  char number[21];
 
-  sendHeader("Content-Type", content_type, true);
+  // "HTTP/1.1 200 OK\r\n" in front of all the rest
+  PGM_P text = _responseCodeText(code);
+  char* end  = formatNumber(number, code);
 
-  if (_contentLength == CONTENT_LENGTH_NOT_SET)
-  {
-    sendHeader("Content-Length", String(contentLength));
-  }
-  else if (_contentLength != CONTENT_LENGTH_UNKNOWN)
-  {
-    sendHeader("Content-Length", String(_contentLength));
-  }
-  else if (_contentLength == CONTENT_LENGTH_UNKNOWN && _currentVersion)
+  size_t textLength   = strlen_P(text);
+  size_t statusLength = 9 + (end - number) + 1 + textLength + 2;
+  char* line          = _headerSpace(0, statusLength, HTTP_HEADER_BUFFER_SIZE);
+
+  if (line)
   {
-    //HTTP/1.1 or above client
-    //let's do chunked
-    _chunked = true;
-    sendHeader("Accept-Ranges", "none");
-    sendHeader("Transfer-Encoding", "chunked");
-  }
+    memcpy_P(line, PSTR("HTTP/1.0 "), 9);
+    line[7] = '0' + _currentVersion;
+    line += 9;
 
-  if (_corsEnabled)
+    memcpy(line, number, end - number);
+    line += end - number;
+    *line++ = ' ';
+
+    memcpy_P(line, text, textLength);
+    line += textLength;
+
+    *line++ = '\r';
+    *line   = '\n';
+  }
+  else
   {
-    sendHeader("Access-Control-Allow-Origin",  "*");
-    sendHeader("Access-Control-Allow-Methods", "*");
-    sendHeader("Access-Control-Allow-Headers", "*");
+    statusLength = 0;
   }
 
-  AT_LOGDEBUG(F("_prepareHeader sendHeader Conn close"));
+  if (!content_type)
+    content_type = mimeTable[html].mimeType;
 
-  sendHeader("Connection", "close");
+  // A 304 stands for content of a type it doesn't know
+  if (code != 304)
+    _headerLine(statusLength, PSTR("Content-Type"), true, content_type, HTTP_HEADER_BUFFER_SIZE);
 
-  aResponse += fromString(_responseHeaders);
-  aResponse += RETURN_NEWLINE;
+  // An HTTP/1.0 client only finds the end of a body of unknown length when the connection closes
+  if (_contentLength == CONTENT_LENGTH_UNKNOWN && !_currentVersion)
+    _keepAlive = false;
 
-  response = fromEWString(aResponse);
+  _keepAliveSent = _keepAlive;
 
-  _responseHeaders = String("");
-}
+  AT_LOGDEBUG1(F("_prepareHeader sendHeader Conn keep-alive ="), _keepAlive);
 
-////////////////////////////////////////
+  // Blank line ending the header, Connection before it, then the other lines go in front of both
+  line = _headerSpace(_responseHeadersLength, 2, HTTP_HEADER_BUFFER_SIZE);
 
-#if !ESP_AT_USE_AVR
+  if (line)
+  {
+    line[0] = '\r';
+    line[1] = '\n';
+  }
 
-////////////////////////////////////////
+  uint16_t tail = _responseHeadersLength;
 
-void ESP8266_AT_WebServer::_prepareHeader(EWString& response, int code, const char* content_type, size_t contentLength)
-{
-  response = "HTTP/1." + fromString(String(_currentVersion)) + " ";
-  response += fromString(String(code));
-  response += " ";
-  response += fromString(_responseCodeToString(code));
-  response += RETURN_NEWLINE;
+  _headerLine(_responseHeadersLength - 2, PSTR("Connection"), true, _keepAlive ? "keep-alive" : "close",
+              HTTP_HEADER_BUFFER_SIZE);
 
-  using namespace mime;
+  tail = _responseHeadersLength - tail + 2;
 
-  if (!content_type)
-    content_type = mimeTable[html].mimeType;
+  _responseHeadersTail = tail;
 
-  sendHeader("Content-Type", content_type, true);
+  // Only complete responses of a known length are kept
+  if ( (code != 200) || (_contentLength != CONTENT_LENGTH_NOT_SET) )
+    _cacheRoute = -1;
 
-  if (_contentLength == CONTENT_LENGTH_NOT_SET)
+  if (code == 304)
+  {
+    // No body, and no length of the body it stands for
+  }
+  else if (_contentLength == CONTENT_LENGTH_NOT_SET)
   {
-    sendHeader("Content-Length", String(contentLength));
+    formatNumber(number, contentLength);
+    _headerLine(_responseHeadersLength - tail, PSTR("Content-Length"), true, number, HTTP_HEADER_BUFFER_SIZE);
   }
   else if (_contentLength != CONTENT_LENGTH_UNKNOWN)
   {
-    sendHeader("Content-Length", String(_contentLength));
+    formatNumber(number, _contentLength);
+    _headerLine(_responseHeadersLength - tail, PSTR("Content-Length"), true, number, HTTP_HEADER_BUFFER_SIZE);
   }
   else if (_contentLength == CONTENT_LENGTH_UNKNOWN && _currentVersion)
   {
     //HTTP/1.1 or above client
     //let's do chunked
     _chunked = true;
-    sendHeader("Accept-Ranges", "none");
-    sendHeader("Transfer-Encoding", "chunked");
+    _headerLine(_responseHeadersLength - tail, PSTR("Transfer-Encoding"), true, "chunked", HTTP_HEADER_BUFFER_SIZE);
   }
 
   if (_corsEnabled)
   {
-    sendHeader("Access-Control-Allow-Origin",  "*");
-    sendHeader("Access-Control-Allow-Methods", "*");
-    sendHeader("Access-Control-Allow-Headers", "*");
+    _headerLine(_responseHeadersLength - tail, PSTR("Access-Control-Allow-Origin"),  true, "*", HTTP_HEADER_BUFFER_SIZE);
+    _headerLine(_responseHeadersLength - tail, PSTR("Access-Control-Allow-Methods"), true, "*", HTTP_HEADER_BUFFER_SIZE);
+    _headerLine(_responseHeadersLength - tail, PSTR("Access-Control-Allow-Headers"), true, "*", HTTP_HEADER_BUFFER_SIZE);
   }
 
-  AT_LOGDEBUG(F("_prepareHeader sendHeader Conn close"));
+  size_t length = _responseHeadersLength;
 
-  sendHeader("Connection", "close");
+  _responseHeadersLength = 0;
 
-  response += fromString(_responseHeaders);
-  response += RETURN_NEWLINE;
-
-  _responseHeaders = String("");
+  return length;
 }
 
 ////////////////////////////////////////
 
-#endif
-
-////////////////////////////////////////
-
 void ESP8266_AT_WebServer::send(int code, const char* content_type, const String& content)
 {
-  EWString header;
+  size_t headerLength = _prepareHeader(code, content_type, content.length());
 
-  _prepareHeader(header, code, content_type, content.length());
-
-  _currentClient.write((const uint8_t *)header.c_str(), header.length());
-
-  if (content.length())
-  {
-    sendContent(content, content.length());
-  }
+  _sendParts(_responseHeaders, headerLength, content.length() ? content.c_str() : NULL, content.length(), false);
 }
 
 ////////////////////////////////////////
 
 void ESP8266_AT_WebServer::send(int code, char* content_type, const String& content, size_t contentLength)
 {
-  EWString header;
-
   char type[64];
 
   memccpy((void*)type, content_type, 0, sizeof(type));
-  _prepareHeader(header, code, (const char* )type, contentLength);
-
-  _currentClient.write((const uint8_t *) header.c_str(), header.length());
+  size_t headerLength = _prepareHeader(code, (const char* )type, contentLength);
 
-  if (contentLength)
-  {
-    sendContent(content, contentLength);
-  }
+  _sendParts(_responseHeaders, headerLength, contentLength ? content.c_str() : NULL, contentLength, false);
 }
 
 ////////////////////////////////////////
@@ -491,73 +1260,76 @@ void ESP8266_AT_WebServer::send(int code, const char* content_type, const char*
 
 void ESP8266_AT_WebServer::send(int code, const char* content_type, const char* content, size_t contentLength)
 {
-  String header;
+  size_t headerLength = _prepareHeader(code, content_type, contentLength);
 
-  _prepareHeader(header, code, content_type, contentLength);
-
-  _currentClient.write((const uint8_t *) header.c_str(), header.length());
-
-  if (contentLength)
-  {
-    sendContent(content, contentLength);
-  }
+  _sendParts(_responseHeaders, headerLength, contentLength ? content : NULL, contentLength, false);
 }
 
 ////////////////////////////////////////
 
 void ESP8266_AT_WebServer::sendContent(const String& content)
 {
-  const char * footer = RETURN_NEWLINE;
-  size_t len = content.length();
+  _sendParts(NULL, 0, content.c_str(), content.length(), false);
+}
 
-  if (_chunked)
-  {
-    char * chunkSize = (char *) malloc(11);
+////////////////////////////////////////
 
-    if (chunkSize)
-    {
-      sprintf(chunkSize, "%x%s", (unsigned int) len, footer);
-      _currentClient.write(chunkSize, strlen(chunkSize));
-      free(chunkSize);
-    }
-  }
+void ESP8266_AT_WebServer::sendContent(const String& content, size_t size)
+{
+  AT_LOGDEBUG1(F("sendContent: Client.write content: "), content);
 
-  _currentClient.write(content.c_str(), len);
+  _sendParts(NULL, 0, content.c_str(), size, false);
+}
 
-  if (_chunked)
-  {
-    _currentClient.write(footer, 2);
-  }
+////////////////////////////////////////
+
+void ESP8266_AT_WebServer::sendContent(const char* content, size_t size)
+{
+  _sendParts(NULL, 0, content, size, false);
 }
 
 ////////////////////////////////////////
 
-void ESP8266_AT_WebServer::sendContent(const String& content, size_t size)
+/*
+  Send the header, if any, then the content, if any, framed as a chunk when the length wasn't known.
+  All the parts leave together, in as few AT+CIPSEND as the module allows.
+*/
+void ESP8266_AT_WebServer::_sendParts(const char* header, size_t headerLength, const char* content, size_t size,
+                                      bool progmem)
 {
   const char * footer = RETURN_NEWLINE;
+  char chunkSize[11];
 
-  if (_chunked)
+  ATIoVec parts[4];
+  uint8_t count = 0;
+
+  if (_cacheRoute >= 0)
+    _cacheStore(header, headerLength, content, size, progmem);
+
+  if (header)
   {
-    char * chunkSize = (char *) malloc(11);
+    parts[count++] = { header, headerLength, false };
+  }
 
-    if (chunkSize)
+  if (content)
+  {
+    if (_chunked)
     {
       AT_LOGDEBUG(F("sendContent: _chunked"));
 
       sprintf(chunkSize, "%x%s", (unsigned int) size, footer);
-      _currentClient.write(chunkSize, strlen(chunkSize));
-      free(chunkSize);
+      parts[count++] = { chunkSize, strlen(chunkSize), false };
     }
-  }
-
-  AT_LOGDEBUG1(F("sendContent: Client.write content: "), content);
 
-  _currentClient.write(content.c_str(), size);
+    parts[count++] = { content, size, progmem };
 
-  if (_chunked)
-  {
-    _currentClient.write(footer, 2);
+    if (_chunked)
+    {
+      parts[count++] = { footer, 2, false };
+    }
   }
+
+  _currentClient.writev(parts, count);
 }
 
 ////////////////////////////////////////
@@ -572,47 +1344,39 @@ void ESP8266_AT_WebServer::send_P(int code, PGM_P content_type, PGM_P content)
     contentLength = strlen_P(content);
   }
 
-  String header;
   char type[64];
 
   memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-  _prepareHeader(header, code, (const char* )type, contentLength);
+  if ( (code == 200) && etag_P(content, contentLength) )
+    return;
+
+  size_t headerLength = _prepareHeader(code, (const char* )type, contentLength);
 
   AT_LOGDEBUG1(F("send_P: len = "), contentLength);
   AT_LOGDEBUG1(F("content = "), content);
-  AT_LOGDEBUG1(F("send_P: hdrlen = "), header.length());
-  AT_LOGDEBUG1(F("header = "), header);
+  AT_LOGDEBUG1(F("send_P: hdrlen = "), headerLength);
 
-  _currentClient.write((const uint8_t *) header.c_str(), header.length());
-
-  if (contentLength)
-  {
-    sendContent_P(content);
-  }
+  _sendParts(_responseHeaders, headerLength, contentLength ? content : NULL, contentLength, true);
 }
 
 ////////////////////////////////////////
 
 void ESP8266_AT_WebServer::send_P(int code, PGM_P content_type, PGM_P content, size_t contentLength)
 {
-  EWString header;
-
   char type[64];
 
   memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-  _prepareHeader(header, code, (const char* )type, contentLength);
+
+  if ( (code == 200) && etag_P(content, contentLength) )
+    return;
+
+  size_t headerLength = _prepareHeader(code, (const char* )type, contentLength);
 
   AT_LOGDEBUG1(F("send_P: len = "), contentLength);
   AT_LOGDEBUG1(F("content = "), content);
-  AT_LOGDEBUG1(F("send_P: hdrlen = "), header.length());
-  AT_LOGDEBUG1(F("header = "), fromEWString(header));
-
-  _currentClient.write((const uint8_t *) header.c_str(), header.length());
+  AT_LOGDEBUG1(F("send_P: hdrlen = "), headerLength);
 
-  if (contentLength)
-  {
-    sendContent_P(content, contentLength);
-  }
+  _sendParts(_responseHeaders, headerLength, contentLength ? content : NULL, contentLength, true);
 }
 
 ////////////////////////////////////////
@@ -626,56 +1390,83 @@ void ESP8266_AT_WebServer::sendContent_P(PGM_P content)
 
 void ESP8266_AT_WebServer::sendContent_P(PGM_P content, size_t size)
 {
-  const char * footer = RETURN_NEWLINE;
+  // straight from flash, no RAM copy
+  _sendParts(NULL, 0, content, size, true);
+}
 
-  if (_chunked)
-  {
-    char * chunkSize = (char *) malloc(11);
+////////////////////////////////////////
 
-    if (chunkSize)
-    {
-      sprintf(chunkSize, "%x%s", (unsigned int) size, footer);
-      _currentClient.write(chunkSize, strlen(chunkSize));
-      free(chunkSize);
-    }
+// FNV-1a, continued from hash
+uint32_t ESP8266_AT_WebServer::_hash(const uint8_t* data, size_t size, bool progmem, uint32_t hash)
+{
+  while (size--)
+  {
+    hash ^= progmem ? pgm_read_byte(data++) : *data++;
+    hash *= 16777619UL;
   }
 
-  uint8_t* buffer = new uint8_t[SENDCONTENT_P_BUFFER_SZ];
+  return hash;
+}
 
-  if (buffer)
-  {
-    uint16_t count = size / SENDCONTENT_P_BUFFER_SZ;
-    uint16_t remainder = size % SENDCONTENT_P_BUFFER_SZ;
-    uint16_t i = 0;
+////////////////////////////////////////
 
-    for (i = 0; i < count; i++)
-    {
-      /* code */
-      memcpy_P(buffer, &content[i * SENDCONTENT_P_BUFFER_SZ], SENDCONTENT_P_BUFFER_SZ);
-      _currentClient.write(buffer, SENDCONTENT_P_BUFFER_SZ);
-    }
+bool ESP8266_AT_WebServer::etag_P(PGM_P content, size_t size)
+{
+  uint8_t entry = 0;
 
-    memcpy_P(buffer, &content[i * SENDCONTENT_P_BUFFER_SZ], remainder);
-    _currentClient.write(buffer, remainder);
+  while ( (entry < HTTP_ETAG_ENTRIES) && !( (_etags[entry].content == content) && (_etags[entry].size == size) ) )
+    entry++;
 
-    delete [] buffer;
-  }
-  else
+  if (entry == HTTP_ETAG_ENTRIES)
   {
-    AT_LOGERROR1(F("sendContent_P: Error, can't allocate buffer, Sz ="), SENDCONTENT_P_BUFFER_SZ);
-    return;
-  }
+    entry     = _etagNext;
+    _etagNext = (_etagNext + 1) % HTTP_ETAG_ENTRIES;
 
-  if (_chunked)
-  {
-    _currentClient.write(footer, 2);
+    _etags[entry].content = content;
+    _etags[entry].size    = size;
+    _etags[entry].hash    = _hash((const uint8_t*) content, size, true);
   }
+
+  return _etag(_etags[entry].hash, size);
+}
+
+////////////////////////////////////////
+
+// Add the ETag of content of size bytes hashing to hash, or answer 304 and return true if the client has it
+bool ESP8266_AT_WebServer::_etag(uint32_t hash, uint32_t size)
+{
+  char tag[32];
+
+  snprintf(tag, sizeof(tag), "\"%lx-%08lx\"", (unsigned long) size, (unsigned long) hash);
+
+  _headerLine(_responseHeadersLength, PSTR("ETag"), true, tag, HTTP_HEADER_BUFFER_SIZE - HTTP_HEADER_RESERVE);
+
+  // A list of tags, weak ones included, or "*"
+  const char* match = _headerValue("If-None-Match");
+
+  if ( !match || ( strcmp(match, "*") && !strstr(match, tag) ) )
+    return false;
+
+  AT_LOGDEBUG1(F("_etag: Not modified "), tag);
+
+  size_t headerLength = _prepareHeader(304, NULL, 0);
+
+  _sendParts(_responseHeaders, headerLength, NULL, 0, false);
+
+  return true;
 }
 
 ////////////////////////////////////////
 
 String ESP8266_AT_WebServer::arg(const String& name)
 {
+  const char* key;
+  const char* value;
+  size_t keyLength, valueLength;
+
+  if (_queryArg(-1, name.c_str(), &key, &keyLength, &value, &valueLength))
+    return _urlDecode(value, valueLength);
+
   for (int i = 0; i < _currentArgCount; ++i)
   {
     if ( _currentArgs[i].key == name )
@@ -689,8 +1480,19 @@ String ESP8266_AT_WebServer::arg(const String& name)
 
 String ESP8266_AT_WebServer::arg(int i)
 {
-  if (i < _currentArgCount)
-    return _currentArgs[i].value;
+  const char* key;
+  const char* value;
+  size_t keyLength, valueLength;
+
+  if (i < _queryArgCount)
+  {
+    if (_queryArg(i, NULL, &key, &keyLength, &value, &valueLength))
+      return _urlDecode(value, valueLength);
+  }
+  else if (i - _queryArgCount < _currentArgCount)
+  {
+    return _currentArgs[i - _queryArgCount].value;
+  }
 
   return String();
 }
@@ -699,23 +1501,59 @@ String ESP8266_AT_WebServer::arg(int i)
 
 String ESP8266_AT_WebServer::argName(int i)
 {
-  if (i < _currentArgCount)
-    return _currentArgs[i].key;
+  const char* key;
+  const char* value;
+  size_t keyLength, valueLength;
+
+  if (i < _queryArgCount)
+  {
+    if (_queryArg(i, NULL, &key, &keyLength, &value, &valueLength))
+      return _urlDecode(key, keyLength);
+  }
+  else if (i - _queryArgCount < _currentArgCount)
+  {
+    return _currentArgs[i - _queryArgCount].key;
+  }
 
   return String();
 }
 
 ////////////////////////////////////////
 
+const char* ESP8266_AT_WebServer::pathArg(unsigned int i)
+{
+  // _parseRequest() ended each of them with a '\0' in the head's copy of the uri
+  if ( (i < _pathArgCount) && _currentConn )
+    return &_currentConn->head[_currentConn->uri + _pathArgs[i][0]];
+
+  return "";
+}
+
+////////////////////////////////////////
+
+int ESP8266_AT_WebServer::pathArgs()
+{
+  return _currentConn ? _pathArgCount : 0;
+}
+
+////////////////////////////////////////
+
 int ESP8266_AT_WebServer::args()
 {
-  return _currentArgCount;
+  return _queryArgCount + _currentArgCount;
 }
 
 ////////////////////////////////////////
 
 bool ESP8266_AT_WebServer::hasArg(const String& name)
 {
+  const char* key;
+  const char* value;
+  size_t keyLength, valueLength;
+
+  if (_queryArg(-1, name.c_str(), &key, &keyLength, &value, &valueLength))
+    return true;
+
   for (int i = 0; i < _currentArgCount; ++i)
   {
     if (_currentArgs[i].key == name)
@@ -729,13 +1567,9 @@ bool ESP8266_AT_WebServer::hasArg(const String& name)
 
 String ESP8266_AT_WebServer::header(const String& name)
 {
-  for (int i = 0; i < _headerKeysCount; ++i)
-  {
-    if (_currentHeaders[i].key == name)
-      return _currentHeaders[i].value;
-  }
+  const char* value = _headerValue(name.c_str());
 
-  return String();
+  return value ? String(value) : String();
 }
 
 ////////////////////////////////////////
@@ -761,7 +1595,7 @@ void ESP8266_AT_WebServer::collectHeaders(const char* headerKeys[], const size_t
 String ESP8266_AT_WebServer::header(int i)
 {
   if (i < _headerKeysCount)
-    return _currentHeaders[i].value;
+    return header(_currentHeaders[i].key);
 
   return String();
 }
@@ -787,20 +1621,18 @@ int ESP8266_AT_WebServer::headers()
 
 bool ESP8266_AT_WebServer::hasHeader(const String& name)
 {
-  for (int i = 0; i < _headerKeysCount; ++i)
-  {
-    if ((_currentHeaders[i].key == name) &&  (_currentHeaders[i].value.length() > 0))
-      return true;
-  }
+  const char* value = _headerValue(name.c_str());
 
-  return false;
+  return value && *value;
 }
 
 ////////////////////////////////////////
 
 String ESP8266_AT_WebServer::hostHeader()
 {
-  return _hostHeader;
+  const char* value = _headerValue("Host");
+
+  return value ? String(value) : String();
 }
 
 ////////////////////////////////////////
@@ -862,8 +1694,8 @@ void ESP8266_AT_WebServer::_handleRequest()
     _finalizeResponse();
   }
 
-  _currentUri = String("");
-
+  _currentUri = "";
+  _cacheRoute = -1;
 }
 
 ////////////////////////////////////////
@@ -878,133 +1710,77 @@ void ESP8266_AT_WebServer::_finalizeResponse()
 
 ////////////////////////////////////////
 
-String ESP8266_AT_WebServer::_responseCodeToString(int code)
+// Reason phrase of each status code, sorted by code
+typedef struct
 {
-  switch (code)
-  {
-    case 100:
-      return F("Continue");
-
-    case 101:
-      return F("Switching Protocols");
-
-    case 200:
-      return F("OK");
-
-    case 201:
-      return F("Created");
-
-    case 202:
-      return F("Accepted");
-
-    case 203:
-      return F("Non-Authoritative Information");
-
-    case 204:
-      return F("No Content");
-
-    case 205:
-      return F("Reset Content");
-
-    case 206:
-      return F("Partial Content");
-
-    case 300:
-      return F("Multiple Choices");
-
-    case 301:
-      return F("Moved Permanently");
-
-    case 302:
-      return F("Found");
-
-    case 303:
-      return F("See Other");
+  uint16_t  code;
+  char      text[32];
+} HTTPStatusText;
 
-    case 304:
-      return F("Not Modified");
-
-    case 305:
-      return F("Use Proxy");
-
-    case 307:
-      return F("Temporary Redirect");
-
-    case 400:
-      return F("Bad Request");
-
-    case 401:
-      return F("Unauthorized");
-
-    case 402:
-      return F("Payment Required");
-
-    case 403:
-      return F("Forbidden");
-
-    case 404:
-      return F("Not Found");
-
-    case 405:
-      return F("Method Not Allowed");
-
-    case 406:
-      return F("Not Acceptable");
-
-    case 407:
-      return F("Proxy Authentication Required");
-
-    case 408:
-      return F("Request Time-out");
-
-    case 409:
-      return F("Conflict");
-
-    case 410:
-      return F("Gone");
-
-    case 411:
-      return F("Length Required");
-
-    case 412:
-      return F("Precondition Failed");
-
-    case 413:
-      return F("Request Entity Too Large");
-
-    case 414:
-      return F("Request-URI Too Large");
-
-    case 415:
-      return F("Unsupported Media Type");
-
-    case 416:
-      return F("Requested range not satisfiable");
-
-    case 417:
-      return F("Expectation Failed");
-
-    case 500:
-      return F("Internal Server Error");
-
-    case 501:
-      return F("Not Implemented");
+static const HTTPStatusText httpStatusTexts[] PROGMEM =
+{
+  { 100, "Continue" },
+  { 101, "Switching Protocols" },
+  { 200, "OK" },
+  { 201, "Created" },
+  { 202, "Accepted" },
+  { 203, "Non-Authoritative Information" },
+  { 204, "No Content" },
+  { 205, "Reset Content" },
+  { 206, "Partial Content" },
+  { 300, "Multiple Choices" },
+  { 301, "Moved Permanently" },
+  { 302, "Found" },
+  { 303, "See Other" },
+  { 304, "Not Modified" },
+  { 305, "Use Proxy" },
+  { 307, "Temporary Redirect" },
+  { 400, "Bad Request" },
+  { 401, "Unauthorized" },
+  { 402, "Payment Required" },
+  { 403, "Forbidden" },
+  { 404, "Not Found" },
+  { 405, "Method Not Allowed" },
+  { 406, "Not Acceptable" },
+  { 407, "Proxy Authentication Required" },
+  { 408, "Request Time-out" },
+  { 409, "Conflict" },
+  { 410, "Gone" },
+  { 411, "Length Required" },
+  { 412, "Precondition Failed" },
+  { 413, "Request Entity Too Large" },
+  { 414, "Request-URI Too Large" },
+  { 415, "Unsupported Media Type" },
+  { 416, "Requested range not satisfiable" },
+  { 417, "Expectation Failed" },
+  { 431, "Request Header Fields Too Large" },
+  { 500, "Internal Server Error" },
+  { 501, "Not Implemented" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Time-out" },
+  { 505, "HTTP Version not supported" }
+};
 
-    case 502:
-      return F("Bad Gateway");
+////////////////////////////////////////
 
-    case 503:
-      return F("Service Unavailable");
+// Reason phrase of code in flash, empty when unknown
+PGM_P ESP8266_AT_WebServer::_responseCodeText(int code)
+{
+  for (size_t i = 0; i < sizeof(httpStatusTexts) / sizeof(httpStatusTexts[0]); i++)
+  {
+    if (pgm_read_word(&httpStatusTexts[i].code) == code)
+      return httpStatusTexts[i].text;
+  }
 
-    case 504:
-      return F("Gateway Time-out");
+  return PSTR("");
+}
 
-    case 505:
-      return F("HTTP Version not supported");
+////////////////////////////////////////
 
-    default:
-      return "";
-  }
+String ESP8266_AT_WebServer::_responseCodeToString(int code)
+{
+  return String((const __FlashStringHelper*) _responseCodeText(code));
 }
 
 ////////////////////////////////////////
@@ -219,6 +219,23 @@ enum HTTPClientStatus
 
 ////////////////////////////////////////
 
+// Where the request head parser of a connection is
+enum HTTPParseState
+{
+  HP_METHOD,
+  HP_URI,
+  HP_VERSION,
+  HP_NAME,
+  HP_VALUE_LEAD,
+  HP_VALUE,
+  HP_SKIP,
+  HP_DONE,
+  HP_URI_TOO_LONG,            // 414
+  HP_HEADERS_TOO_LARGE        // 431
+};
+
+////////////////////////////////////////
+
 enum HTTPAuthMethod
 {
   BASIC_AUTH,
@@ -227,7 +244,14 @@ enum HTTPAuthMethod
 
 ////////////////////////////////////////
 
-#define HTTP_DOWNLOAD_UNIT_SIZE 1460
+// Blocks serveStatic() reads and sends files in
+#if !defined(HTTP_DOWNLOAD_UNIT_SIZE)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_DOWNLOAD_UNIT_SIZE 256
+  #else
+    #define HTTP_DOWNLOAD_UNIT_SIZE 1460
+  #endif
+#endif
 
 // Permit user to increase HTTP_UPLOAD_BUFLEN larger than default 2K
 #if !defined(HTTP_UPLOAD_BUFLEN)
@@ -239,8 +263,117 @@ enum HTTPAuthMethod
 #define HTTP_MAX_SEND_WAIT      5000 //ms to wait for data chunk to be ACKed
 #define HTTP_MAX_CLOSE_WAIT     2000 //ms to wait for the client to close the connection
 
-#define CONTENT_LENGTH_UNKNOWN  ((size_t) -1)
-#define CONTENT_LENGTH_NOT_SET  ((size_t) -2)
+// Persistent connections (HTTP/1.1, or HTTP/1.0 with "Connection: keep-alive")
+#if !defined(HTTP_KEEP_ALIVE_TIMEOUT)
+  #define HTTP_KEEP_ALIVE_TIMEOUT   2000  //ms an idle persistent connection is kept open
+#endif
+
+#if !defined(HTTP_KEEP_ALIVE_MAX)
+  #define HTTP_KEEP_ALIVE_MAX       10    //requests served on one connection before closing it
+#endif
+
+#if !defined(HTTP_KEEP_ALIVE_RESERVE)
+  #define HTTP_KEEP_ALIVE_RESERVE   1     //links kept free for new clients, idle connections are closed for them
+#endif
+
+/*
+  Static RAM taken on a Mega 2560 (8 KB) with the default sizes, about 2.2 KB:
+    socket queues         MAX_SOCK_NUM x AT_SOCK_RX_BUFFER_SIZE     4 x 128     512
+    AT response buffer    ringBuf                                               512
+    request heads         MAX_SOCK_NUM x HTTP_HEAD_BUFFER_SIZE      4 x 128     512
+    response header       HTTP_HEADER_BUFFER_SIZE                               256
+    tag matcher           5 x AT_TAG_MAX_STATES + AT_TAG_MAX_LEN                272
+    command and notification queues, line buffer, ETags                        ~150
+  The HTTP_CACHE_SIZE pool comes on top, allocated by the first cache() only.
+  Define smaller sizes before including the library to leave more to the sketch.
+*/
+
+// Request line and wanted headers of each connection, other headers are skipped.
+// A request line which does not fit gets a 414, headers which do not fit a 431.
+#if !defined(HTTP_HEAD_BUFFER_SIZE)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_HEAD_BUFFER_SIZE   128
+  #elif ( defined(STM32F2) || defined(STM32F3) )
+    #define HTTP_HEAD_BUFFER_SIZE   256
+  #else
+    #define HTTP_HEAD_BUFFER_SIZE   512
+  #endif
+#endif
+
+// Response header, status line included. sendHeader() lines can't use the last HTTP_HEADER_RESERVE bytes,
+// kept for the headers the server adds itself: by default that leaves 96 bytes for them on Mega and F1, 352 elsewhere.
+// sendHeader() returns false for a line which doesn't fit, and the response goes without it.
+#if !defined(HTTP_HEADER_BUFFER_SIZE)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_HEADER_BUFFER_SIZE 256
+  #else
+    #define HTTP_HEADER_BUFFER_SIZE 512
+  #endif
+#endif
+
+#if !defined(HTTP_HEADER_RESERVE)
+  #define HTTP_HEADER_RESERVE       160
+#endif
+
+// Response cache, see cache(). The pool is only allocated by the first cache() call.
+#if !defined(HTTP_CACHE_SIZE)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_CACHE_SIZE         512
+  #elif ( defined(STM32F2) || defined(STM32F3) )
+    #define HTTP_CACHE_SIZE         1024
+  #else
+    #define HTTP_CACHE_SIZE         4096
+  #endif
+#endif
+
+#if !defined(HTTP_CACHE_MAX_ENTRIES)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_CACHE_MAX_ENTRIES  4
+  #else
+    #define HTTP_CACHE_MAX_ENTRIES  8
+  #endif
+#endif
+
+// Flash contents whose ETag is remembered, see etag_P()
+#if !defined(HTTP_ETAG_ENTRIES)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_ETAG_ENTRIES       4
+  #else
+    #define HTTP_ETAG_ENTRIES       8
+  #endif
+#endif
+
+// Largest serveStatic() file read once more for its ETag when the file system has no modification time,
+// larger ones get none
+#if !defined(HTTP_ETAG_MAX_FILE_SIZE)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_ETAG_MAX_FILE_SIZE 2048
+  #else
+    #define HTTP_ETAG_MAX_FILE_SIZE 8192
+  #endif
+#endif
+
+#if !defined(HTTP_CACHE_MAX_ROUTES)
+  #define HTTP_CACHE_MAX_ROUTES     4
+#endif
+
+// Parameters of an on("/api/relay/{id}/state") route, see pathArg()
+#if !defined(HTTP_MAX_PATH_ARGS)
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define HTTP_MAX_PATH_ARGS      4
+  #else
+    #define HTTP_MAX_PATH_ARGS      8
+  #endif
+#endif
+
+// Longest uri pattern of an ATRoute, with its '\0'
+#if !defined(HTTP_ROUTE_URI_SIZE)
+  #define HTTP_ROUTE_URI_SIZE       32
+#endif
+
+// Content lengths are 32 bits, size_t being 16 on AVR
+#define CONTENT_LENGTH_UNKNOWN  ((uint32_t) -1)
+#define CONTENT_LENGTH_NOT_SET  ((uint32_t) -2)
 
 /////////////////////////////////////////////////////////////////////////
 
@@ -307,7 +440,28 @@ typedef struct
 
 ////////////////////////////////////////
 
+typedef void (*ATRouteFunction)(void);
+
+/*
+   One entry of a route table kept in flash, see on(const ATRoute*, size_t):
+
+   const ATRoute routes[] PROGMEM =
+   {
+     { HTTP_GET, "/",                      handleRoot  },
+     { HTTP_ANY, "/api/relay/{id}/state",  handleRelay },
+   };
+*/
+typedef struct
+{
+  uint8_t         method;                         // HTTPMethod
+  char            uri[HTTP_ROUTE_URI_SIZE];       // As for on(): exact, "/path/*", or with {param}
+  ATRouteFunction fn;
+} ATRoute;
+
+////////////////////////////////////////
+
 #include "utility/RequestHandler.h"
+#include "utility/ATFileSystem.h"
 
 ////////////////////////////////////////
 
@@ -334,9 +488,43 @@ class ESP8266_AT_WebServer
     void on(const String &uri, HTTPMethod method, THandlerFunction fn);
     void on(const String &uri, HTTPMethod method, THandlerFunction fn, THandlerFunction ufn);
     void addHandler(RequestHandler* handler);
+
+    // Routes searched in place, which take no RAM each. They come after the handlers registered before.
+    void on(const ATRoute* routes, size_t count);
+
+    template<size_t N> void on(const ATRoute (&routes)[N])
+    {
+      on(routes, N);
+    }
+
+    // Serve the gzip compressed flash asset of uri as-is to the clients which accept gzip, plain to the others,
+    // or 406 Not Acceptable without plain. contentType is in flash too.
+    void onAsset_P(const String& uri, PGM_P contentType, PGM_P gzipped, size_t gzippedLength,
+                   PGM_P plain = NULL, size_t plainLength = 0);
+
+    // Serve the files under path of fs at uri, or the file path if it is one. The Cache-Control of
+    // their responses is cache_header, if any. A gzip copy, path.gz, goes to the clients accepting it.
+    void serveStatic(const char* uri, ATFileSystem& fs, const char* path, const char* cache_header = NULL);
+
     void onNotFound(THandlerFunction fn);  //called when handler is not assigned
     void onFileUpload(THandlerFunction fn); //handle file uploads
 
+    // Keep the 200 responses to GET uri for ttl ms and send them again without calling the handler.
+    // withQuery keeps one response per query string, else the query is ignored.
+    bool cache(const String& uri, unsigned long ttl, bool withQuery = false);
+    void invalidate(const String& uri);     // drop the kept responses of uri
+    void invalidate();                      // drop all kept responses
+
+    uint32_t cacheHits()
+    {
+      return _cacheHits;
+    }
+
+    uint32_t cacheMisses()
+    {
+      return _cacheMisses;
+    }
+
     ////////////////////////////////////////
 
     String uri()
@@ -372,6 +560,8 @@ class ESP8266_AT_WebServer
     String argName(int i);                  // get request argument name by number
 
     int args();                             // get arguments count
+    const char* pathArg(unsigned int i);    // get path parameter of an on("/{id}") route by number, in the request buffer
+    int pathArgs();                         // get path parameters count
     bool hasArg(const String& name);        // check if argument exists
     void collectHeaders(const char* headerKeys[], const size_t headerKeysCount); // set the request headers to collect
     String header(const String& name);      // get request header value by name
@@ -379,6 +569,7 @@ class ESP8266_AT_WebServer
     String headerName(int i);               // get request header name by number
     int headers();                          // get header count
     bool hasHeader(const String& name);     // check if header exists
+    bool acceptsGzip();                     // check if the client accepts gzip content encoding
 
     String hostHeader();                    // get request host header if available or empty String if not
 
@@ -410,10 +601,11 @@ class ESP8266_AT_WebServer
 
     ////////////////////////////////////////
 
-    void setContentLength(size_t contentLength);
-    void sendHeader(const String& name, const String& value, bool first = false);
+    void setContentLength(uint32_t contentLength);
+    bool sendHeader(const String& name, const String& value, bool first = false);
     void sendContent(const String& content);
     void sendContent(const String& content, size_t size);
+    void sendContent(const char* content, size_t size);
 
     // KH, Restore PROGMEM commands
     void send_P(int code, PGM_P content_type, PGM_P content);
@@ -422,14 +614,19 @@ class ESP8266_AT_WebServer
     void sendContent_P(PGM_P content);
     void sendContent_P(PGM_P content, size_t size);
 
+    // Add the ETag of flash content to the response, or answer 304 Not Modified and return true
+    // when the client already has it. send_P() does it for its 200 responses, call it before
+    // send() to do the same for a page sent with sendContent_P().
+    bool etag_P(PGM_P content, size_t size);
+
     static String urlDecode(const String& text);
 
     ////////////////////////////////////////
 
-    template<typename T> size_t streamFile(T &file, const String& contentType)
+    // The single byte range a Range header asks for gets a 206, seeking file to it
+    template<typename T> uint32_t streamFile(T &file, const String& contentType)
     {
       using namespace mime;
-      setContentLength(file.size());
 
       if (String(file.name()).endsWith(mimeTable[gz].endsWith) && contentType != mimeTable[gz].mimeType
           && contentType != mimeTable[none].mimeType)
@@ -437,18 +634,37 @@ class ESP8266_AT_WebServer
         sendHeader("Content-Encoding", "gzip");
       }
 
-      send(200, contentType, "");
-
-      return _currentClient.write(file);
+      return _streamBody(file, file.size(), contentType);
     }
 
     ////////////////////////////////////////
 
   protected:
-    void _addRequestHandler(RequestHandler* handler);
+    friend class StaticRequestHandler;
+
+    void _addRequestHandler(RequestHandler* handler, const String* uri = NULL, HTTPMethod method = HTTP_ANY,
+                            bool table = false);
+    RequestHandler* _findHandler(HTTPMethod method, const String& uri);
     void _handleRequest();
     void _finalizeResponse();
     bool _parseRequest(ESP8266_AT_Client& client);
+    bool _readHead(uint8_t sock);
+    void _resetHead(uint8_t sock);
+    bool _wantHeader(const char* headerName, bool prefix = false);
+    const char* _headerValue(const char* headerName);
+    bool _queryArg(int index, const char* name, const char** key, size_t* keyLength, const char** value, size_t* valueLength);
+    static String _urlDecode(const char* text, size_t length);
+    void _closeConnection(uint8_t sock);
+    uint8_t _freeLinks();
+    void _reclaimLink();
+    int8_t _range(uint32_t size, uint32_t* start, uint32_t* length);
+    static uint32_t _hash(const uint8_t* data, size_t size, bool progmem, uint32_t hash = 2166136261UL);
+    bool _etag(uint32_t hash, uint32_t size);
+    bool _cacheServe();
+    void _cacheStore(const char* header, size_t headerLength, const char* content, size_t size, bool progmem);
+    int8_t _cacheFind();
+    size_t _cacheKeyLength(const char** query);
+    void _cacheRemove(uint8_t entry);
 
     void _parseArguments(const String& data);
     int  _parseArgumentsPrivate(const String& data,
@@ -456,16 +672,100 @@ class ESP8266_AT_WebServer
     bool _parseForm(ESP8266_AT_Client& client, const String& boundary, uint32_t len);
 
     static String _responseCodeToString(int code);
+    static PGM_P _responseCodeText(int code);
     bool _parseFormUploadAborted();
     void _uploadWriteByte(uint8_t b);
+    void _uploadFlushBuf();
     uint8_t _uploadReadByte(ESP8266_AT_Client& client);
-    void _prepareHeader(String& response, int code, const char* content_type, size_t contentLength);
+    uint8_t _uploadReadSpan(ESP8266_AT_Client& client);
+    size_t _prepareHeader(int code, const char* content_type, size_t contentLength);
+    char* _headerSpace(uint16_t pos, size_t length, size_t limit);
+    bool _headerLine(uint16_t pos, const char* name, bool progmem, const char* value, size_t limit);
+    void _sendParts(const char* header, size_t headerLength, const char* content, size_t size, bool progmem);
 
-#if !ESP_AT_USE_AVR
-    void _prepareHeader(EWString& response, int code, const char* content_type, size_t contentLength);
-#endif
+    ////////////////////////////////////////
 
-    bool _collectHeader(const char* headerName, const char* headerValue);
+    static uint8_t* _downloadBuffer()
+    {
+      // Shared by streamFile() and serveStatic(), one request is served at a time
+      static uint8_t buffer[HTTP_DOWNLOAD_UNIT_SIZE];
+
+      return buffer;
+    }
+
+    ////////////////////////////////////////
+
+    // Send file, size bytes, or the byte range asked for, in HTTP_DOWNLOAD_UNIT_SIZE blocks
+    template<typename T> uint32_t _streamBody(T& file, uint32_t size, const String& contentType)
+    {
+      uint32_t start  = 0;
+      uint32_t length = size;
+      int code      = 200;
+      char range[48];
+
+      // Like sendHeader(), leaving room for the headers of _prepareHeader()
+      const size_t limit = HTTP_HEADER_BUFFER_SIZE - HTTP_HEADER_RESERVE;
+
+      switch (_range(size, &start, &length))
+      {
+        case 1:
+          snprintf(range, sizeof(range), "bytes %lu-%lu/%lu", (unsigned long) start,
+                   (unsigned long) (start + length - 1), (unsigned long) size);
+
+          // A 206 can't go without its Content-Range: with no room for it, or no seek, all of the file is sent
+          if ( (_responseHeadersLength + sizeof("Content-Range: \r\n") - 1 + strlen(range) <= limit)
+               && file.seek(start) )
+          {
+            _headerLine(_responseHeadersLength, PSTR("Content-Range"), true, range, limit);
+            code = 206;
+          }
+          else
+          {
+            AT_LOGDEBUG(F("_streamBody: Range ignored"));
+
+            start  = 0;
+            length = size;
+          }
+
+          break;
+
+        case -1:
+          snprintf(range, sizeof(range), "bytes */%lu", (unsigned long) size);
+          _headerLine(_responseHeadersLength, PSTR("Content-Range"), true, range, limit);
+          send(416);
+
+          return 0;
+      }
+
+      // Optional, after Content-Range for a full buffer to drop it first
+      _headerLine(_responseHeadersLength, PSTR("Accept-Ranges"), true, "bytes", limit);
+
+      setContentLength(length);
+      send(code, contentType, "");
+
+      uint8_t* buffer = _downloadBuffer();
+      uint32_t sent   = 0;
+
+      while (sent < length)
+      {
+        int count = file.read(buffer, (size_t) min((uint32_t) HTTP_DOWNLOAD_UNIT_SIZE, length - sent));
+
+        if (count <= 0)
+          break;
+
+        sendContent((const char*) buffer, count);
+        sent += count;
+      }
+
+      // A short file leaves the client waiting for the rest, only closing the connection ends it
+      if (sent < length)
+      {
+        AT_LOGERROR1(F("_streamBody: Short read, sent"), sent);
+        _keepAliveSent = false;
+      }
+
+      return sent;
+    }
 
     ////////////////////////////////////////
 
@@ -485,17 +785,81 @@ class ESP8266_AT_WebServer
     HTTPMethod          _currentMethod;
     String              _currentUri;
     uint8_t             _currentVersion;
-    HTTPClientStatus    _currentStatus;
-    unsigned long       _statusChange;
 
     RequestHandler*   _currentHandler   = nullptr;
     RequestHandler*   _firstHandler     = nullptr;
     RequestHandler*   _lastHandler      = nullptr;
+
+    // Route index: on() uris first, sorted, then "/*" routes and addHandler() ones in registration order
+    struct RouteEntry
+    {
+      const char*       uri;          // Uri, prefix of a "/*" route or compiled pattern, NULL for addHandler()
+      uint16_t          length;       // Of the prefix, PATTERN for a pattern, or TABLE
+      HTTPMethod        method;
+      RequestHandler*   handler;
+      uint16_t          order;        // Registration order
+
+      static const uint16_t PATTERN = 0xFFFF;
+      static const uint16_t TABLE   = 0xFFFE;     // handler is a RouteTableRequestHandler
+    };
+
+    RouteEntry*       _routes           = nullptr;
+    uint16_t          _routeCount       = 0;
+    uint16_t          _routeExact       = 0;  // Sorted entries at the start of _routes
+    uint16_t          _routeCapacity    = 0;
+
+    // Start and end of each path parameter in the uri
+    uint16_t          _pathArgs[HTTP_MAX_PATH_ARGS][2];
+    uint8_t           _pathArgCount     = 0;
+
+    // Responses kept by cache(). Each entry is its key, the path and maybe '?' and the query, then
+    // the header without its Connection line, then the body, in _cachePool in the order they were stored.
+    struct CacheRoute
+    {
+      String            uri;
+      unsigned long     ttl;
+      bool              withQuery;
+    };
+
+    struct CacheEntry
+    {
+      uint16_t          offset;
+      uint16_t          keyLength;
+      uint16_t          headLength;
+      uint16_t          bodyLength;
+      uint8_t           route;
+      unsigned long     stored;       // millis()
+    };
+
+    CacheRoute        _cacheRoutes[HTTP_CACHE_MAX_ROUTES];
+    uint8_t           _cacheRouteCount  = 0;
+    CacheEntry        _cacheEntries[HTTP_CACHE_MAX_ENTRIES];
+    uint8_t           _cacheEntryCount  = 0;
+    char*             _cachePool        = nullptr;
+    uint16_t          _cacheUsed        = 0;
+    int8_t            _cacheRoute       = -1;   // Of the request being handled, -1 if it isn't cached
+    int8_t            _cacheStored      = -1;   // Entry its response went to
+    uint32_t          _cacheHits        = 0;
+    uint32_t          _cacheMisses      = 0;
+
+    // Hashed on first use, replaced in turn
+    struct ETagEntry
+    {
+      PGM_P             content;
+      size_t            size;
+      uint32_t          hash;
+    };
+
+    ETagEntry         _etags[HTTP_ETAG_ENTRIES];
+    uint8_t           _etagNext         = 0;
     THandlerFunction    _notFoundHandler;
     THandlerFunction    _fileUploadHandler;
 
+    // Arguments of the request body, those of the query are read from the head when asked for
     int                 _currentArgCount;
     RequestArgument*  _currentArgs      = nullptr;
+    const char*       _currentQuery     = nullptr;
+    int               _queryArgCount;
 
     HTTPUpload*       _currentUpload    = nullptr;
     int               _postArgsLen;
@@ -503,11 +867,34 @@ class ESP8266_AT_WebServer
 
     int              _headerKeysCount;
     RequestArgument*  _currentHeaders   = nullptr;
-    size_t           _contentLength;
-    String           _responseHeaders;
-
-    String           _hostHeader;
+    uint32_t         _contentLength;
+    char             _responseHeaders[HTTP_HEADER_BUFFER_SIZE];
+    uint16_t         _responseHeadersLength;
+    uint16_t         _responseHeadersTail;  // Connection line and blank line ending the last header
     bool             _chunked;
+    bool             _keepAlive;        // The connection may stay open after this request
+    bool             _keepAliveSent;    // and the response said so
+
+    // Per link id
+    struct HTTPConnection
+    {
+      HTTPClientStatus  status;
+      unsigned long     statusChange;
+      uint8_t           requests;     // Already served on this connection
+      uint8_t           parse;        // HTTPParseState
+      uint8_t           version;      // Minor HTTP version
+      uint16_t          len;          // Bytes of head used
+      uint16_t          line;         // Where the header line being read starts in head
+      uint16_t          uri;
+      uint16_t          headers;      // Wanted headers, as "name\0value\0" pairs up to len
+      char              head[HTTP_HEAD_BUFFER_SIZE];
+    };
+
+    HTTPConnection   _conn[MAX_SOCK_NUM];
+    HTTPConnection*  _currentConn;    // The one being served
+
+    static bool _headPut(HTTPConnection& conn, char c, uint8_t tooLarge);
+    uint8_t          _nextConn;
 };
 
 ////////////////////////////////////////
@@ -37,6 +37,11 @@
   #define WEBSERVER_MAX_POST_ARGS 32
 #endif
 
+// Stack chunk used to copy request bodies out of the client in one go
+#ifndef HTTP_READ_CHUNK_SIZE
+  #define HTTP_READ_CHUNK_SIZE    64
+#endif
+
 ////////////////////////////////////////
 
 static bool readBytesWithTimeout(ESP8266_AT_Client& client, size_t maxLength, String& data, int timeout_ms)
@@ -60,8 +65,32 @@ static bool readBytesWithTimeout(ESP8266_AT_Client& client, size_t maxLength, St
     if (data.length() + avail > maxLength)
       avail = maxLength - data.length();
 
-    while (avail--)
-      data += (char)client.read();
+    // Copy whole spans instead of one client.read() per byte
+    char chunk[HTTP_READ_CHUNK_SIZE];
+
+    while (avail)
+    {
+      int len = client.read((uint8_t *) chunk, min(avail, sizeof(chunk) - 1));
+
+      if (len <= 0)
+        break;
+
+      chunk[len] = 0;
+      avail -= len;
+
+      // += of a C string stops at '\0', binary bodies keep theirs
+      for (const char* pos = chunk; pos < chunk + len; )
+      {
+        data += pos;
+        pos  += strlen(pos);
+
+        if (pos < chunk + len)
+        {
+          data += (char) 0;
+          pos++;
+        }
+      }
+    }
   }
 
   return data.length() == maxLength;
@@ -69,42 +98,69 @@ static bool readBytesWithTimeout(ESP8266_AT_Client& client, size_t maxLength, St
 
 ////////////////////////////////////////
 
-bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
+// Compare URL encoded text with name, without decoding it into a copy
+static bool urlEquals(const char* text, size_t length, const char* name)
 {
-  // Read the first line of HTTP request
-  String req = client.readStringUntil('\r');
-  client.readStringUntil('\n');
+  char temp[]   = "0x00";
+  size_t i      = 0;
 
-  //reset header value
-  for (int i = 0; i < _headerKeysCount; ++i)
+  while (i < length)
   {
-    _currentHeaders[i].value = String();
+    char decodedChar = text[i++];
+
+    if ((decodedChar == '%') && (i + 1 < length))
+    {
+      temp[2] = text[i++];
+      temp[3] = text[i++];
+
+      decodedChar = strtol(temp, NULL, 16);
+    }
+    else if (decodedChar == '+')
+    {
+      decodedChar = ' ';
+    }
+
+    if (*name++ != decodedChar)
+      return false;
   }
 
-  // First line of HTTP request looks like "GET /path HTTP/1.1"
-  // Retrieve the "/path" part by finding the spaces
-  int addr_start = req.indexOf(' ');
-  int addr_end = req.indexOf(' ', addr_start + 1);
+  return (*name == 0);
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
+{
+  HTTPConnection& conn = *_currentConn;
+
+  // _readHead() left "method\0uri\0", then the wanted headers
+  char* methodStr = conn.head;
+  char* url       = &conn.head[conn.uri];
 
-  if (addr_start == -1 || addr_end == -1)
+  if ( (conn.uri == 0) || (*url == 0) )
   {
-    AT_LOGDEBUG1(F("_parseRequest: Invalid request: "), req);
+    AT_LOGDEBUG1(F("_parseRequest: Invalid request: "), methodStr);
     return false;
   }
 
-  AT_LOGDEBUG1(F("_parseRequest: request ="), req);
+  _currentVersion   = conn.version;
+  _currentArgCount  = 0;
+  _queryArgCount    = 0;
 
-  String methodStr  = req.substring(0, addr_start);
-  String url        = req.substring(addr_start + 1, addr_end);
-  String versionEnd = req.substring(addr_end + 8);
-  _currentVersion   = atoi(versionEnd.c_str());
-  String searchStr  = "";
-  int hasSearch     = url.indexOf('?');
+  char* search      = strchr(url, '?');
 
-  if (hasSearch != -1)
+  if (search)
   {
-    searchStr = urlDecode(url.substring(hasSearch + 1));
-    url       = url.substring(0, hasSearch);
+    // The arguments stay in the head, they are found and decoded when asked for
+    *search++     = 0;
+    _currentQuery = search;
+
+    const char* key;
+    const char* value;
+    size_t keyLength, valueLength;
+
+    while (_queryArg(_queryArgCount, NULL, &key, &keyLength, &value, &valueLength))
+      _queryArgCount++;
   }
 
   _currentUri = url;
@@ -112,27 +168,27 @@ bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
 
   HTTPMethod method = HTTP_GET;
 
-  if (methodStr == "HEAD")
+  if (!strcmp_P(methodStr, PSTR("HEAD")))
   {
     method = HTTP_HEAD;
   }
-  else if (methodStr == "POST")
+  else if (!strcmp_P(methodStr, PSTR("POST")))
   {
     method = HTTP_POST;
   }
-  else if (methodStr == "DELETE")
+  else if (!strcmp_P(methodStr, PSTR("DELETE")))
   {
     method = HTTP_DELETE;
   }
-  else if (methodStr == "OPTIONS")
+  else if (!strcmp_P(methodStr, PSTR("OPTIONS")))
   {
     method = HTTP_OPTIONS;
   }
-  else if (methodStr == "PUT")
+  else if (!strcmp_P(methodStr, PSTR("PUT")))
   {
     method = HTTP_PUT;
   }
-  else if (methodStr == "PATCH")
+  else if (!strcmp_P(methodStr, PSTR("PATCH")))
   {
     method = HTTP_PATCH;
   }
@@ -141,96 +197,70 @@ bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
 
   AT_LOGDEBUG1(F("method: "), methodStr);
   AT_LOGDEBUG1(F("url: "), url);
-  AT_LOGDEBUG1(F("search: "), searchStr);
+  AT_LOGDEBUG1(F("search: "), _currentQuery ? _currentQuery : "");
+
+  // HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only when asked
+  const char* connection = _headerValue("Connection");
+
+  if (connection)
+    _keepAlive = _currentVersion ? strcasecmp_P(connection, PSTR("close")) : !strcasecmp_P(connection, PSTR("keep-alive"));
+  else
+    _keepAlive = (_currentVersion != 0);
 
   //attach handler
-  RequestHandler* handler;
+  _currentHandler = _findHandler(_currentMethod, _currentUri);
 
-  for (handler = _firstHandler; handler; handler = handler->next())
-  {
-    if (handler->canHandle(_currentMethod, _currentUri))
-      break;
-  }
+  // _currentUri is a copy, the path parameters can be cut in the head
+  for (uint8_t i = 0; i < _pathArgCount; i++)
+    url[_pathArgs[i][1]] = 0;
+
+  bool hasBody = (method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_DELETE);
 
-  _currentHandler = handler;
+  // A body left unread would be parsed as the next request: only a Content-Length one read whole below
+  // lets the connection stay open
+  const char* bodyLength = _headerValue("Content-Length");
 
-  String formData;
+  if ( _headerValue("Transfer-Encoding") || ( !hasBody && bodyLength && atol(bodyLength) ) )
+    _keepAlive = false;
 
   // below is needed only when POST type request
-  if (method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_DELETE)
+  if (hasBody)
   {
     String boundaryStr;
-    String headerName;
-    String headerValue;
 
     bool isEncoded  = false;
     bool isForm     = false;
 
-    uint32_t contentLength = 0;
+    const char* contentType   = _headerValue("Content-Type");
+    const char* lengthStr     = _headerValue("Content-Length");
+    uint32_t    contentLength = lengthStr ? atol(lengthStr) : 0;
 
-    //parse headers
-    while (1)
+    AT_LOGDEBUG1(F("Content-Type: "), contentType ? contentType : "");
+    AT_LOGDEBUG1(F("Content-Length: "), contentLength);
+
+    //KH
+    if (contentType)
     {
-      req = client.readStringUntil('\r');
-      client.readStringUntil('\n');
+      using namespace mime;
 
-      if (req == "")
+      if (!strncmp(contentType, mimeTable[txt].mimeType, strlen(mimeTable[txt].mimeType)))
       {
-        AT_LOGDEBUG(F("POST_PUT_PATCH_DELETE: No more header"));
-
-        break;//no more headers
+        isForm = false;
       }
-
-      int headerDiv = req.indexOf(':');
-
-      if (headerDiv == -1)
+      else if (!strncmp_P(contentType, PSTR("application/x-www-form-urlencoded"), 33))
       {
-        AT_LOGDEBUG(F("headerDiv = -1"));
-
-        break;
+        isForm = false;
+        isEncoded = true;
       }
-
-      headerName  = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 1);
-
-      headerValue.trim();
-      _collectHeader(headerName.c_str(), headerValue.c_str());
-
-      AT_LOGDEBUG1(F("headerName: "), headerName);
-      AT_LOGDEBUG1(F("headerValue: "), headerValue);
-
-      //KH
-      if (headerName.equalsIgnoreCase("Content-Type"))
+      else if (!strncmp_P(contentType, PSTR("multipart/"), 10))
       {
-        using namespace mime;
+        const char* equal = strchr(contentType, '=');
 
-        if (headerValue.startsWith(mimeTable[txt].mimeType))
-        {
-          isForm = false;
-        }
-        else if (headerValue.startsWith("application/x-www-form-urlencoded"))
-        {
-          isForm = false;
-          isEncoded = true;
-        }
-        else if (headerValue.startsWith("multipart/"))
-        {
-          boundaryStr = headerValue.substring(headerValue.indexOf('=') + 1);
-          // KH
-          boundaryStr.replace("\"", "");
-          //
-          isForm = true;
-        }
-      }
-      //KH
-      else if (headerName.equalsIgnoreCase("Content-Length"))
-      {
-        contentLength = headerValue.toInt();
-      }
-      //KH
-      else if (headerName.equalsIgnoreCase("Host"))
-      {
-        _hostHeader = headerValue;
+        boundaryStr = equal ? equal + 1 : contentType;
+        // KH
+        boundaryStr.replace("\"", "");
+        //
+        isForm = true;
       }
     }
 
@@ -246,23 +276,13 @@ bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
       return false;
     }
 
-    if (isEncoded)
-    {
-      // isEncoded => !isForm => plainBuf is not empty
-      // add plainBuf in search str
-      if (searchStr.length())
-        searchStr += '&';
-
-      searchStr += plainBuf;
-    }
-
-    // parse searchStr for key/value pairs
-    _parseArguments(searchStr);
-
     if (!isForm)
     {
       if (contentLength)
       {
+        // key=value pairs of an encoded body, and room for {"plain": plainBuf}
+        _parseArguments(isEncoded ? plainBuf : String());
+
         // add key=value: plain={body} (post json or other data)
         RequestArgument& arg = _currentArgs[_currentArgCount++];
         arg.key = F("plain");
@@ -273,91 +293,226 @@ bool ESP8266_AT_WebServer::_parseRequest(ESP8266_AT_Client& client)
     {
       // isForm is true
       // here: content is not yet read (plainBuf is still empty)
+      // and _parseForm() may stop before its end
+      _keepAlive = false;
+
       if (!_parseForm(client, boundaryStr, contentLength))
       {
         return false;
       }
     }
   }
-  else
+
+  // Whatever follows is the next request of a persistent connection
+  if (!_keepAlive)
+    client.flush();
+
+  AT_LOGDEBUG1(F("Request:"), url);
+  AT_LOGDEBUG1(F("Arguments:"), _queryArgCount + _currentArgCount);
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// Those _parseRequest() and the responses need, one after the other
+static const char builtinHeaders[] PROGMEM =
+  "Host\0Connection\0Content-Type\0Content-Length\0If-None-Match\0Accept-Encoding\0Range\0Transfer-Encoding\0";
+
+////////////////////////////////////////
+
+// Also true for the start of a wanted name when prefix, that of one too long to be kept
+bool ESP8266_AT_WebServer::_wantHeader(const char* headerName, bool prefix)
+{
+  size_t length = strlen(headerName);
+
+  for (PGM_P wanted = builtinHeaders; pgm_read_byte(wanted); wanted += strlen_P(wanted) + 1)
   {
-    String headerName;
-    String headerValue;
+    if ( prefix ? !strncasecmp_P(headerName, wanted, length) : !strcasecmp_P(headerName, wanted) )
+      return true;
+  }
 
-    //parse headers
-    while (1)
+  // Then the ones asked for with collectHeaders()
+  for (int i = 0; i < _headerKeysCount; i++)
+  {
+    //KH
+    if ( prefix ? !strncasecmp(_currentHeaders[i].key.c_str(), headerName, length)
+         : !strcasecmp(_currentHeaders[i].key.c_str(), headerName) )
     {
-      AT_LOGDEBUG(F("GET_HEAD_OPTIONS: while start"));
+      return true;
+    }
+  }
 
-      //req = client.readStringUntil('\r');
-      //client.readStringUntil('\n');
-      req = client.readStringUntil(0x0D);
+  return false;
+}
 
-      AT_LOGDEBUG1(F("GET_HEAD_OPTIONS: req ="), req);
+////////////////////////////////////////
 
-      client.readStringUntil(0x0A);
+const char* ESP8266_AT_WebServer::_headerValue(const char* headerName)
+{
+  if (!_currentConn || (_currentConn->parse != HP_DONE))
+    return NULL;
 
-      if (req == "")
-      {
-        AT_LOGDEBUG(F("GET_HEAD_OPTIONS: No more header"));
+  const char* pos = &_currentConn->head[_currentConn->headers];
+  const char* end = &_currentConn->head[_currentConn->len];
 
-        break;//no more headers
-      }
+  while (pos < end)
+  {
+    const char* value = pos + strlen(pos) + 1;
 
-      int headerDiv = req.indexOf(':');
+    if (!strcasecmp(pos, headerName))
+      return value;
 
-      if (headerDiv == -1)
-      {
-        AT_LOGDEBUG(F("headerDiv = -1"));
+    pos = value + strlen(value) + 1;
+  }
 
-        break;
-      }
+  return NULL;
+}
 
-      headerName  = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 2);
-      _collectHeader(headerName.c_str(), headerValue.c_str());
+////////////////////////////////////////
 
-      AT_LOGDEBUG1(F("headerName:"), headerName);
-      AT_LOGDEBUG1(F("headerValue:"), headerValue);
+// Accept-Encoding lists gzip, or "*", without q=0
+bool ESP8266_AT_WebServer::acceptsGzip()
+{
+  const char* pos = _headerValue("Accept-Encoding");
 
-      if (headerName.equalsIgnoreCase(F("Host")))
-      {
-        _hostHeader = headerValue;
-      }
+  while (pos && *pos)
+  {
+    while ( (*pos == ' ') || (*pos == ',') )
+      pos++;
+
+    const char* end = pos;
+
+    while (*end && (*end != ',') && (*end != ';') && (*end != ' '))
+      end++;
+
+    bool coding = ( (end - pos == 4) && !strncasecmp(pos, "gzip", 4) ) || ( (end - pos == 1) && (*pos == '*') );
+
+    const char* next = strchr(end, ',');
+
+    if (coding)
+    {
+      // Of its parameters, only a zero quality matters
+      const char* q = strstr(end, "q=");
+
+      if (!q || (next && (q > next)))
+        return true;
+
+      for (q += 2; (*q == '0') || (*q == '.'); q++)
+        ;
+
+      return (*q && (*q != ',') && (*q != ' '));
     }
 
-    _parseArguments(searchStr);
+    pos = next;
+  }
+
+  return false;
+}
+
+////////////////////////////////////////
+
+/*
+  1 and the byte range of size the Range header asks for, from start, 0 when there is none to honor,
+  or -1 when it starts past the end. Several ranges get the whole content.
+*/
+int8_t ESP8266_AT_WebServer::_range(uint32_t size, uint32_t* start, uint32_t* length)
+{
+  const char* value = _headerValue("Range");
+  char* end;
+
+  if (!value || strncasecmp(value, "bytes=", 6) || strchr(value, ','))
+    return 0;
 
-    AT_LOGDEBUG(F("GET_HEAD_OPTIONS: while end"));
+  value += 6;
+
+  if (*value == '-')
+  {
+    // The last bytes
+    unsigned long suffix = strtoul(value + 1, &end, 10);
+
+    if ( (end == value + 1) || *end )
+      return 0;
+
+    if (!suffix || !size)
+      return -1;
+
+    *length = min((uint32_t) suffix, size);
+    *start  = size - *length;
+
+    return 1;
   }
 
-  client.flush();
+  unsigned long first = strtoul(value, &end, 10);
 
-  AT_LOGDEBUG1(F("Request:"), url);
-  AT_LOGDEBUG1(F("Arguments:"), searchStr);
-  AT_LOGDEBUG (F("Final list of key/value pairs:"));
+  if ( (end == value) || (*end != '-') )
+    return 0;
+
+  value = end + 1;
+
+  unsigned long last = size - 1;
 
-  for (int i = 0; i < _currentArgCount; i++)
+  if (*value)
   {
-    AT_LOGDEBUG1("key:",   _currentArgs[i].key.c_str());
-    AT_LOGDEBUG1("value:", _currentArgs[i].value.c_str());
+    last = strtoul(value, &end, 10);
+
+    if ( (end == value) || *end || (last < first) )
+      return 0;
+
+    if (last >= size)
+      last = size - 1;
   }
 
-  return true;
+  if (first >= size)
+    return -1;
+
+  *start  = first;
+  *length = last - first + 1;
+
+  return 1;
 }
 
 ////////////////////////////////////////
 
-bool ESP8266_AT_WebServer::_collectHeader(const char* headerName, const char* headerValue)
+/*
+   Find the query argument number index, or the one named name if not NULL. key and value point
+   into the head, still URL encoded; value is NULL for an argument without '='.
+*/
+bool ESP8266_AT_WebServer::_queryArg(int index, const char* name, const char** key, size_t* keyLength,
+                                     const char** value, size_t* valueLength)
 {
-  for (int i = 0; i < _headerKeysCount; i++)
+  const char* pos = _currentQuery;
+  int count = 0;
+
+  if (!pos)
+    return false;
+
+  while (*pos)
   {
-    //KH
-    if (_currentHeaders[i].key.equalsIgnoreCase(headerName))
+    size_t length     = strcspn(pos, "&;");
+    const char* equal = (const char*) memchr(pos, '=', length);
+    size_t keyEnd     = equal ? (size_t) (equal - pos) : length;
+
+    // skip empty expression
+    if (keyEnd > 0)
     {
-      _currentHeaders[i].value = headerValue;
-      return true;
+      if (name ? urlEquals(pos, keyEnd, name) : (count == index))
+      {
+        *key          = pos;
+        *keyLength    = keyEnd;
+        *value        = equal ? equal + 1 : NULL;
+        *valueLength  = equal ? length - keyEnd - 1 : 0;
+
+        return true;
+      }
+
+      count++;
     }
+
+    pos += length;
+
+    if (*pos)
+      pos++;
   }
 
   return false;
@@ -463,15 +618,22 @@ int ESP8266_AT_WebServer::_parseArgumentsPrivate(const String& data,
 
 ////////////////////////////////////////
 
+void ESP8266_AT_WebServer::_uploadFlushBuf()
+{
+  if (_currentHandler && _currentHandler->canUpload(_currentUri))
+    _currentHandler->upload(*this, _currentUri, *_currentUpload);
+
+  _currentUpload->totalSize += _currentUpload->currentSize;
+  _currentUpload->currentSize = 0;
+}
+
+////////////////////////////////////////
+
 void ESP8266_AT_WebServer::_uploadWriteByte(uint8_t b)
 {
   if (_currentUpload->currentSize == HTTP_UPLOAD_BUFLEN)
   {
-    if (_currentHandler && _currentHandler->canUpload(_currentUri))
-      _currentHandler->upload(*this, _currentUri, *_currentUpload);
-
-    _currentUpload->totalSize += _currentUpload->currentSize;
-    _currentUpload->currentSize = 0;
+    _uploadFlushBuf();
   }
 
   _currentUpload->buf[_currentUpload->currentSize++] = b;
@@ -496,6 +658,34 @@ uint8_t ESP8266_AT_WebServer::_uploadReadByte(ESP8266_AT_Client& client)
 
 ////////////////////////////////////////
 
+// Copy file data straight from the client into the upload buffer, up to the next CR.
+// Returns 0x0D if the CR was reached, else falls back to _uploadReadByte() to wait for more data.
+uint8_t ESP8266_AT_WebServer::_uploadReadSpan(ESP8266_AT_Client& client)
+{
+  bool found = false;
+  size_t len;
+
+  do
+  {
+    if (_currentUpload->currentSize == HTTP_UPLOAD_BUFLEN)
+    {
+      _uploadFlushBuf();
+    }
+
+    len = client.readBytesUntil(0x0D, &_currentUpload->buf[_currentUpload->currentSize],
+                                HTTP_UPLOAD_BUFLEN - _currentUpload->currentSize, &found);
+
+    _currentUpload->currentSize += len;
+  } while (len > 0 && !found);
+
+  if (found)
+    return 0x0D;
+
+  return _uploadReadByte(client);
+}
+
+////////////////////////////////////////
+
 bool ESP8266_AT_WebServer::_parseForm(ESP8266_AT_Client& client, const String& boundary, uint32_t len)
 {
   (void) len;
@@ -639,7 +829,7 @@ readfile:
                 return _parseFormUploadAborted();
 
               _uploadWriteByte(argByte);
-              argByte = _uploadReadByte(client);
+              argByte = _uploadReadSpan(client);
             }
 
             argByte = _uploadReadByte(client);
@@ -792,21 +982,30 @@ bool ESP8266_AT_WebServer::_parseFormUploadAborted()
 ////////////////////////////////////////
 
 String ESP8266_AT_WebServer::urlDecode(const String& text)
+{
+  return _urlDecode(text.c_str(), text.length());
+}
+
+////////////////////////////////////////
+
+String ESP8266_AT_WebServer::_urlDecode(const char* text, size_t len)
 {
   String decoded    = "";
   char temp[]       = "0x00";
-  unsigned int len  = text.length();
   unsigned int i    = 0;
 
+  if (!decoded.reserve(len))
+    return decoded;
+
   while (i < len)
   {
     char decodedChar;
-    char encodedChar = text.charAt(i++);
+    char encodedChar = text[i++];
 
     if ((encodedChar == '%') && (i + 1 < len))
     {
-      temp[2] = text.charAt(i++);
-      temp[3] = text.charAt(i++);
+      temp[2] = text[i++];
+      temp[3] = text[i++];
 
       decodedChar = strtol(temp, NULL, 16);
     }
@@ -0,0 +1,259 @@
+/****************************************************************************************************************************
+  ATFileSystem.h - Dead simple web-server.
+  For ESP8266/ESP32 AT-command running shields
+
+  ESP8266_AT_WebServer is a library for the ESP8266/ESP32 AT-command shields to run WebServer
+  Based on and modified from ESP8266 https://github.com/esp8266/Arduino/releases
+  Built by Khoi Hoang https://github.com/khoih-prog/ESP8266_AT_WebServer
+  Licensed under MIT license
+
+  Original author:
+  @file       Esp8266WebServer.h
+  @author     Ivan Grokhotkov
+
+  Version: 1.7.1
+
+  Version Modified By   Date      Comments
+  ------- -----------  ---------- -----------
+  1.0.0   K Hoang      12/02/2020 Initial coding for Arduino Mega, Teensy, etc
+  ...
+  1.6.0   K Hoang      16/11/2022 Fix severe limitation to permit sending larger data than 2K buffer. Add CORS
+  1.7.0   K Hoang      16/01/2023 Add support to WizNet WizFi360 such as WIZNET_WIZFI360_EVB_PICO
+  1.7.1   K Hoang      17/01/2023 Fix AP and version bugs for WizNet WizFi360
+ *****************************************************************************************************************************/
+
+#ifndef ATFileSystem_h
+#define ATFileSystem_h
+
+#include <Arduino.h>
+
+////////////////////////////////////////
+
+/*
+  The files serveStatic() reads. The server handles one request at a time, so one file is open at a time:
+  open() makes path the current file, and the other calls work on it.
+  Derive from it for a file system ATFileSystemAdapter doesn't fit.
+*/
+class ATFileSystem
+{
+  public:
+
+    virtual ~ATFileSystem() { }
+
+    // false if path is missing or a directory
+    virtual bool open(const char* path) = 0;
+
+    // 32 bits, size_t being 16 on AVR
+    virtual uint32_t size() = 0;
+    virtual bool seek(uint32_t pos) = 0;
+
+    // Bytes read into buffer, 0 at the end of the file
+    virtual size_t read(uint8_t* buffer, size_t length) = 0;
+
+    // When the file was last written, in any unit, 0 if unknown. Makes its ETag without reading it
+    virtual uint32_t lastModified()
+    {
+      return 0;
+    }
+
+    virtual void close() = 0;
+};
+
+////////////////////////////////////////
+
+/*
+  Any file system with a File open(path) like SD's, whose File has operator bool, isDirectory(),
+  size(), seek(), read(buffer, length) and close():
+
+    ATFileSystemAdapter<SDClass, File> sdFiles(SD);
+    server.serveStatic("/", sdFiles, "/www/", "max-age=3600");
+
+  Derive from it for a lastModified() from _file, if its File has one.
+*/
+template<typename FS, typename File>
+class ATFileSystemAdapter : public ATFileSystem
+{
+  public:
+
+    ////////////////////////////////////////
+
+    ATFileSystemAdapter(FS& fs)
+      : _fs(fs)
+    {
+    }
+
+    ////////////////////////////////////////
+
+    bool open(const char* path) override
+    {
+      close();
+
+      _file = _fs.open(path);
+
+      if (_file && _file.isDirectory())
+        close();
+
+      return (bool) _file;
+    }
+
+    ////////////////////////////////////////
+
+    uint32_t size() override
+    {
+      return _file ? _file.size() : 0;
+    }
+
+    ////////////////////////////////////////
+
+    bool seek(uint32_t pos) override
+    {
+      return _file && _file.seek(pos);
+    }
+
+    ////////////////////////////////////////
+
+    size_t read(uint8_t* buffer, size_t length) override
+    {
+      if (!_file)
+        return 0;
+
+      int count = _file.read(buffer, length);
+
+      return (count > 0) ? count : 0;
+    }
+
+    ////////////////////////////////////////
+
+    void close() override
+    {
+      if (_file)
+        _file.close();
+
+      _file = File();
+    }
+
+    ////////////////////////////////////////
+
+  protected:
+
+    FS&   _fs;
+    File  _file;
+};
+
+////////////////////////////////////////
+
+// One file of an ATMemoryFileSystem
+typedef struct
+{
+  const char*     path;
+  const uint8_t*  data;
+  uint32_t        size;
+} ATMemoryFile;
+
+////////////////////////////////////////
+
+/*
+  Files built into the sketch, their data in PROGMEM if progmem:
+
+    static const char indexHtml[] PROGMEM = "<html>...</html>";
+    static const ATMemoryFile wwwFiles[] = { { "/www/index.htm", (const uint8_t*) indexHtml, sizeof(indexHtml) - 1 } };
+
+    ATMemoryFileSystem wwwFs(wwwFiles, 1, true);
+    server.serveStatic("/", wwwFs, "/www/");
+*/
+class ATMemoryFileSystem : public ATFileSystem
+{
+  public:
+
+    ////////////////////////////////////////
+
+    ATMemoryFileSystem(const ATMemoryFile* files, uint8_t count, bool progmem = false)
+      : _files(files)
+      , _count(count)
+      , _progmem(progmem)
+      , _file(NULL)
+      , _pos(0)
+    {
+    }
+
+    ////////////////////////////////////////
+
+    bool open(const char* path) override
+    {
+      close();
+
+      for (uint8_t i = 0; i < _count; i++)
+      {
+        if (!strcmp(_files[i].path, path))
+        {
+          _file = &_files[i];
+
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    ////////////////////////////////////////
+
+    uint32_t size() override
+    {
+      return _file ? _file->size : 0;
+    }
+
+    ////////////////////////////////////////
+
+    bool seek(uint32_t pos) override
+    {
+      if (!_file || (pos > _file->size))
+        return false;
+
+      _pos = pos;
+
+      return true;
+    }
+
+    ////////////////////////////////////////
+
+    size_t read(uint8_t* buffer, size_t length) override
+    {
+      if (!_file)
+        return 0;
+
+      if (length > _file->size - _pos)
+        length = _file->size - _pos;
+
+      if (_progmem)
+        memcpy_P(buffer, _file->data + _pos, length);
+      else
+        memcpy(buffer, _file->data + _pos, length);
+
+      _pos += length;
+
+      return length;
+    }
+
+    ////////////////////////////////////////
+
+    void close() override
+    {
+      _file = NULL;
+      _pos  = 0;
+    }
+
+    ////////////////////////////////////////
+
+  protected:
+
+    const ATMemoryFile* _files;
+    uint8_t             _count;
+    bool                _progmem;
+
+    const ATMemoryFile* _file;
+    uint32_t            _pos;
+};
+
+////////////////////////////////////////
+
+#endif    // ATFileSystem_h
@@ -93,7 +93,7 @@
 
 ////////////////////////////////////////
 
-#define NUMESPTAGS 5
+#define NUMESPTAGS 6
 
 ////////////////////////////////////////
 
@@ -103,7 +103,8 @@ const char* ESPTAGS[] =
   "\r\nERROR\r\n",
   "\r\nFAIL\r\n",
   "\r\nSEND OK\r\n",
-  " CONNECT\r\n"
+  " CONNECT\r\n",
+  "busy "
 };
 
 ////////////////////////////////////////
@@ -114,7 +115,8 @@ typedef enum
   TAG_ERROR,
   TAG_FAIL,
   TAG_SENDOK,
-  TAG_CONNECT
+  TAG_CONNECT,
+  TAG_BUSY
 } TagsEnum;
 
 ////////////////////////////////////////
@@ -141,6 +143,8 @@ Stream *ESP8266_AT_Drv::espSerial = NULL;
   #endif
 #endif
 
+AT_TagMatcher ESP8266_AT_Drv::tagMatcher(ESPTAGS, NUMESPTAGS);
+
 ////////////////////////////////////////
 
 // Array of data to cache the information related to the networks discovered
@@ -161,6 +165,41 @@ uint8_t ESP8266_AT_Drv::_connId     = 0;
 uint16_t  ESP8266_AT_Drv::_remotePort = 0;
 uint8_t   ESP8266_AT_Drv::_remoteIp[] = {0};
 
+const char* ESP8266_AT_Drv::_readSlowTag  = NULL;
+
+AT_SocketBuffer ESP8266_AT_Drv::_sockRx[MAX_SOCK_NUM];
+uint8_t         ESP8266_AT_Drv::_sockState[MAX_SOCK_NUM]          = { AT_SOCK_UNKNOWN };
+unsigned long   ESP8266_AT_Drv::_sockStateMillis[MAX_SOCK_NUM]    = { 0 };
+uint8_t         ESP8266_AT_Drv::_sockRemoteIp[MAX_SOCK_NUM][4]    = { { 0 } };
+uint16_t        ESP8266_AT_Drv::_sockRemotePort[MAX_SOCK_NUM]     = { 0 };
+uint16_t        ESP8266_AT_Drv::_sockPending[MAX_SOCK_NUM]        = { 0 };
+uint8_t         ESP8266_AT_Drv::_recvMode                         = AT_RECV_ACTIVE;
+uint8_t         ESP8266_AT_Drv::_recvModeWanted                   = AT_RECV_DEFAULT;
+
+uint32_t        ESP8266_AT_Drv::_baudRate                         = AT_DEFAULT_BAUD_RATE;
+bool            ESP8266_AT_Drv::_flowControl                      = false;
+
+uint8_t         ESP8266_AT_Drv::_wifiState                        = WL_IDLE_STATUS;
+unsigned long   ESP8266_AT_Drv::_wifiStateMillis                  = 0;
+
+ATUrcCallback   ESP8266_AT_Drv::_urcCallback[NUM_AT_URC]          = { NULL };
+uint8_t         ESP8266_AT_Drv::_urcQueue[AT_URC_QUEUE_SIZE][2];
+uint8_t         ESP8266_AT_Drv::_urcCount                         = 0;
+bool            ESP8266_AT_Drv::_urcDispatching                   = false;
+
+bool            ESP8266_AT_Drv::_passthrough                      = false;
+uint8_t         ESP8266_AT_Drv::_ptSock                           = SOCK_NOT_AVAIL;
+unsigned long   ESP8266_AT_Drv::_frameMillis                      = 0;
+int             ESP8266_AT_Drv::_lastSendResult                   = AT_CMD_OK;
+uint32_t        ESP8266_AT_Drv::_rxRescued                        = 0;
+uint32_t        ESP8266_AT_Drv::_rxDropped                        = 0;
+char            ESP8266_AT_Drv::_lineBuf[AT_LINE_MAX_LEN];
+uint8_t         ESP8266_AT_Drv::_lineLen                          = 0;
+
+ATCommand   ESP8266_AT_Drv::_cmdQueue[AT_CMD_QUEUE_SIZE];
+int8_t      ESP8266_AT_Drv::_cmdCurrent   = -1;
+uint8_t     ESP8266_AT_Drv::_cmdSeq       = 0;
+
 ////////////////////////////////////////
 
 // KH New from v1.0.8
@@ -240,11 +279,12 @@ void ESP8266_AT_Drv::wifiDriverReInit()
 
 ////////////////////////////////////////
 
-void ESP8266_AT_Drv::wifiDriverInit(Stream *espSerial)
+void ESP8266_AT_Drv::wifiDriverInit(Stream *espSerial, uint8_t recvMode)
 {
   AT_LOGDEBUG(F("> wifiDriverInit"));
 
   ESP8266_AT_Drv::espSerial = espSerial;
+  _recvModeWanted = recvMode;
 
   wifiDriverReInit();
 }
@@ -258,6 +298,10 @@ void ESP8266_AT_Drv::reset()
   AT_LOGINFO(F("AT+RST"));
   sendCmd(F("AT+RST"));
 
+  // AT+UART_CUR doesn't survive the reset
+  _baudRate    = AT_DEFAULT_BAUD_RATE;
+  _flowControl = false;
+
   delay(3000);
   espEmptyBuf(false);  // empty dirty characters from the buffer
 
@@ -289,6 +333,25 @@ void ESP8266_AT_Drv::reset()
   AT_LOGINFO(F("AT+CIPDINFO=1"));
   sendCmd(F("AT+CIPDINFO=1"));
 
+  // Passive mode: the module keeps the received data until we ask for it with AT+CIPRECVDATA
+  _recvMode = AT_RECV_ACTIVE;
+
+  if (_recvModeWanted == AT_RECV_PASSIVE)
+  {
+    AT_LOGINFO(F("AT+CIPRECVMODE=1"));
+
+    if (sendCmd(F("AT+CIPRECVMODE=1")) == TAG_OK)
+    {
+      _recvMode = AT_RECV_PASSIVE;
+    }
+    else
+    {
+      AT_LOGWARN(F("Passive receive mode not supported, using active mode"));
+    }
+  }
+
+  memset(_sockPending, 0, sizeof(_sockPending));
+
   // Disable autoconnect
   // Automatic connection can create problems during initialization phase at next boot
   AT_LOGINFO(F("AT+CWAUTOCONN=0"));
@@ -707,6 +770,10 @@ uint8_t ESP8266_AT_Drv::getConnectionStatus()
         1: ESP8266 runs as server
   */
 
+  // "WIFI DISCONNECT" just received, no need to ask
+  if ( (_wifiState == WL_DISCONNECTED) && (millis() - _wifiStateMillis < AT_SOCK_RESYNC_TIME) )
+    return WL_DISCONNECTED;
+
   char buf[10];
 
   memset(buf, 0, sizeof(buf));
@@ -721,17 +788,34 @@ uint8_t ESP8266_AT_Drv::getConnectionStatus()
   int s = atoi(buf);
 
   if (s == 2 or s == 3 or s == 4)
-    return WL_CONNECTED;
+    _wifiState = WL_CONNECTED;
   else if (s == 5)
-    return WL_DISCONNECTED;
+    _wifiState = WL_DISCONNECTED;
+  else
+    _wifiState = WL_IDLE_STATUS;
 
-  return WL_IDLE_STATUS;
+  _wifiStateMillis = millis();
+
+  return _wifiState;
 }
 
 ////////////////////////////////////////
 
 uint8_t ESP8266_AT_Drv::getClientState(uint8_t sock)
 {
+  // In passthrough mode the module doesn't report the state of the connection
+  if (_passthrough)
+    return (sock == _ptSock);
+
+  if (sock < MAX_SOCK_NUM)
+  {
+    // Process the notifications already received, then trust them for a while
+    pumpData();
+
+    if ( (_sockState[sock] != AT_SOCK_UNKNOWN) && (millis() - _sockStateMillis[sock] < AT_SOCK_RESYNC_TIME) )
+      return (_sockState[sock] == AT_SOCK_CONNECTED);
+  }
+
   // KH add to fix dirty buf issue
   espEmptyBuf(true);  // empty dirty characters from the buffer
 
@@ -750,11 +834,16 @@ uint8_t ESP8266_AT_Drv::getClientState(uint8_t sock)
   if (sendCmdGet("AT+CIPSTATUS", findBuf, ",", buf, sizeof(buf)))
   {
     AT_LOGDEBUG(F("Connected"));
+
+    setSockState(sock, AT_SOCK_CONNECTED);
+
     return true;
   }
 
   AT_LOGDEBUG(F("Not connected"));
 
+  setSockState(sock, AT_SOCK_CLOSED);
+
   return false;
 }
 
@@ -983,6 +1072,10 @@ uint8_t ESP8266_AT_Drv::getScanNetworks()
   uint8_t ssidListNum = 0;
   int idx;
 
+  if (_passthrough)
+    return passthroughActive();
+
+  waitCmdIdle();
   espEmptyBuf();
 
   AT_LOGDEBUG(F("----------------------------------------------"));
@@ -1156,6 +1249,97 @@ char* ESP8266_AT_Drv::getFwVersion()
 
 ////////////////////////////////////////
 
+bool ESP8266_AT_Drv::setBaudRate(uint32_t baud, ATBaudRateHook hook, bool flowControl)
+{
+  AT_LOGDEBUG1(F("> setBaudRate"), baud);
+
+  if (hook == NULL)
+    return false;
+
+  uint32_t oldBaud = _baudRate;
+  bool     oldFlow = _flowControl;
+
+  if (!setUart(baud, flowControl))
+  {
+    AT_LOGERROR1(F("AT+UART_CUR not supported, staying at"), oldBaud);
+    return false;
+  }
+
+  hook(baud, flowControl);
+
+  if (checkLink())
+  {
+    _baudRate    = baud;
+    _flowControl = flowControl;
+
+    AT_LOGINFO1(F("UART rate now"), baud);
+
+    return true;
+  }
+
+  AT_LOGERROR1(F("No answer at"), baud);
+
+  // The module may still understand some of what we send, ask it to go back blindly
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    setUart(oldBaud, oldFlow);
+    delay(100);
+  }
+
+  hook(oldBaud, oldFlow);
+
+  if (!checkLink())
+  {
+    AT_LOGERROR(F("Module lost, reset it to get back to the default rate"));
+  }
+
+  return false;
+}
+
+////////////////////////////////////////
+
+uint32_t ESP8266_AT_Drv::getBaudRate()
+{
+  return _baudRate;
+}
+
+////////////////////////////////////////
+
+// AT+UART_CUR=<baudrate>,<databits>,<stopbits>,<parity>,<flow control>
+// The module answers OK at the old rate, then switches
+bool ESP8266_AT_Drv::setUart(uint32_t baud, bool flowControl)
+{
+  AT_LOGINFO2(F("AT+UART_CUR="), baud, flowControl ? 3 : 0);
+
+  int ret = sendCmd(F("AT+UART_CUR=%lu,8,1,0,%d"), 1000, (unsigned long) baud, flowControl ? 3 : 0);
+
+  // let the module switch before talking to it at the new rate
+  espSerial->flush();
+  delay(50);
+
+  return (ret == TAG_OK);
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::checkLink()
+{
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    // garbage received during the switch
+    espEmptyBuf(false);
+
+    if (sendCmd(F("AT")) == TAG_OK)
+      return true;
+
+    delay(100);
+  }
+
+  return false;
+}
+
+////////////////////////////////////////
+
 bool ESP8266_AT_Drv::ping(const char *host)
 {
   AT_LOGDEBUG(F("> ping"));
@@ -1190,6 +1374,8 @@ bool ESP8266_AT_Drv::startClient(const char* host, uint16_t port, uint8_t sock,
 {
   AT_LOGDEBUG2(F("> startClient"), host, port);
 
+  resetSocket(sock);
+
   // TCP
   // AT+CIPSTART=<link ID>,"TCP",<remote IP>,<remote port>
 
@@ -1242,6 +1428,8 @@ bool ESP8266_AT_Drv::startClient(const char* host, uint16_t port, uint8_t sock,
 
   //////
 
+  setSockState(sock, (ret == TAG_OK) ? AT_SOCK_CONNECTED : AT_SOCK_CLOSED);
+
   return ret == TAG_OK;
 }
 
@@ -1252,273 +1440,208 @@ void ESP8266_AT_Drv::stopClient(uint8_t sock)
 {
   AT_LOGDEBUG1(F("> stopClient"), sock);
 
+  if (_passthrough && (sock == _ptSock))
+  {
+    stopPassthrough();
+    return;
+  }
+
   AT_LOGINFO1(F("AT+CIPCLOSE="), sock);
 
   sendCmd(F("AT+CIPCLOSE=%d"), 4000, sock);
+
+  resetSocket(sock);
 }
 
 ////////////////////////////////////////
 
-uint8_t ESP8266_AT_Drv::getServerState(uint8_t sock)
+/*
+  Open a TCP connection in passthrough (transparent) mode: once the module is in
+  AT+CIPMODE=1 and AT+CIPSEND, everything written to the UART goes to the connection
+  and everything received comes raw from the UART.
+  Only possible in single connection mode, refused by the module while a server runs
+  or other links are open.
+*/
+bool ESP8266_AT_Drv::startPassthrough(const char* host, uint16_t port, uint8_t sock)
 {
-  ESP_AT_UNUSED(sock);
+  AT_LOGDEBUG2(F("> startPassthrough"), host, port);
 
-  return 0;
-}
+  if (_passthrough || (sock >= MAX_SOCK_NUM))
+    return false;
 
-////////////////////////////////////////////////////////////////////////////
-// TCP/IP functions
-////////////////////////////////////////////////////////////////////////////
+  AT_LOGINFO(F("AT+CIPMUX=0"));
 
-uint16_t ESP8266_AT_Drv::availData(uint8_t connId)
-{
-  // if there is data in the buffer
-  if (_bufPos > 0)
+  if (sendCmd(F("AT+CIPMUX=0")) != TAG_OK)
   {
-    // KH
-    //AT_LOGDEBUG1(F("availData: _bufPos="), _bufPos);
-    //AT_LOGDEBUG1(_connId, connId);
-
-    if (_connId == connId)
-      return _bufPos;
-    else if (_connId == 0)
-      return _bufPos;
+    AT_LOGERROR(F("Can't use single connection mode, close the other links and servers"));
+    return false;
   }
 
-  int bytes = espSerial->available();
+  bool ok = false;
 
-  // KH
-  //AT_LOGERROR1(F("availData: bytes="), bytes);
+  AT_LOGINFO2(F("AT+CIPSTART=TCP"), host, port);
 
-  if (bytes)
+  if ( (sendCmd(F("AT+CIPSTART=\"TCP\",\"%s\",%u"), 5000, host, port) == TAG_OK)
+       && (sendCmd(F("AT+CIPMODE=1")) == TAG_OK) )
   {
-    // KH
-    //AT_LOGERROR1(F("Bytes in the serial buffer: "), bytes);
+    waitCmdIdle();
+    espEmptyBuf();
 
-    if (espSerial->find((char *)"+IPD,"))
-    {
-      // format is : +IPD,<id>,<len>:<data>
-      // format is : +IPD,<ID>,<len>[,<remote IP>,<remote port>]:<data>
-
-      _connId = espSerial->parseInt();    // <ID>
-      espSerial->read();                  // ,
-      _bufPos = espSerial->parseInt();    // <len>
-      espSerial->read();                  // "
-      _remoteIp[0] = espSerial->parseInt();    // <remote IP>
-      espSerial->read();                  // .
-      _remoteIp[1] = espSerial->parseInt();
-      espSerial->read();                  // .
-      _remoteIp[2] = espSerial->parseInt();
-      espSerial->read();                  // .
-      _remoteIp[3] = espSerial->parseInt();
-      espSerial->read();                  // "
-      espSerial->read();                  // ,
-      _remotePort = espSerial->parseInt();     // <remote port>
-
-      espSerial->read();                  // :
-
-      AT_LOGDEBUG();
-      AT_LOGDEBUG2(F("Data packet"), _connId, _bufPos);
-
-      if (_connId == connId || connId == 0)
-        return _bufPos;
-    }
+    espSerial->println(F("AT+CIPSEND"));
+
+    ok = (readPrompt(2000) == NUMESPTAGS);
   }
 
-  return 0;
-}
+  if (!ok)
+  {
+    AT_LOGERROR(F("Passthrough mode failed"));
 
-////////////////////////////////////////
+    sendCmd(F("AT+CIPMODE=0"));
+    waitCmd(queueCmd((const char*) F("AT+CIPCLOSE"), true, 4000, NULL, NULL, NULL, 0, NULL));
+    sendCmd(F("AT+CIPMUX=1"));
 
-bool ESP8266_AT_Drv::getData(uint8_t connId, uint8_t *data, bool peek, bool* connClose)
-{
-  if (connId != _connId)
     return false;
+  }
 
-  // see Serial.timedRead
-
-  long _startMillis = millis();
+  resetSocket(sock);
+  setSockState(sock, AT_SOCK_CONNECTED);
 
-  do
-  {
-    if (espSerial->available())
-    {
-      if (peek)
-      {
-        *data = (char)espSerial->peek();
-      }
-      else
-      {
-        *data = (char)espSerial->read();
-        _bufPos--;
-      }
+  _ptSock      = sock;
+  _passthrough = true;
 
-      //AT_LOGDEBUG1(F("Data at location = 0x"), String( (char)*data, HEX));
-      //AT_LOGERROR3(F("Data at location = "), _bufPos + 1, ", data =", (char)*data );
+  AT_LOGINFO1(F("Passthrough mode on socket"), sock);
 
-      if (_bufPos == 0)
-      {
-        // after the data packet a ",CLOSED" string may be received
-        // this means that the socket is now closed
+  return true;
+}
 
-        delay(5);
+////////////////////////////////////////
 
-        if (espSerial->available())
-        {
-          //AT_LOGDEBUG(F(".2"));
-          //AT_LOGDEBUG(espSerial->peek());
+// Leave passthrough mode with "+++", close the connection and go back to multiple connections mode
+void ESP8266_AT_Drv::stopPassthrough()
+{
+  if (!_passthrough)
+    return;
 
-          // 48 = '0'
-          if (espSerial->peek() == 48 + connId)
-          {
-            int idx = readUntil(500, ",CLOSED\r\n", false);
+  AT_LOGDEBUG(F("> stopPassthrough"));
 
-            if (idx != NUMESPTAGS)
-            {
-              AT_LOGERROR(F("Tag CLOSED not found"));
-            }
+  // "+++" is only recognized alone, with no data just before or after it
+  espSerial->flush();
+  delay(AT_PASSTHROUGH_GUARD_TIME);
 
-            AT_LOGDEBUG();
-            AT_LOGDEBUG(F("Connection closed"));
+  espSerial->print(F("+++"));
 
-            *connClose = true;
-          }
-        }
-      }
+  delay(AT_PASSTHROUGH_EXIT_TIME);
 
-      return true;
-    }
-  } while (millis() - _startMillis < 500 /*2000*/);
+  // what came before "+++" is still data
+  pumpData();
 
-  // timed out, reset the buffer
-  AT_LOGDEBUG1(F("ESP8266_AT_Drv::getData: TIMEOUT @ bufPos ="), _bufPos);
-  AT_LOGDEBUG1(F("Data at bad location = 0x"), String( (char)*data, HEX));
+  _passthrough = false;
 
-  _bufPos = 0;
-  _connId = 0;
-  *data = 0;
+  sendCmd(F("AT+CIPMODE=0"));
+  waitCmd(queueCmd((const char*) F("AT+CIPCLOSE"), true, 4000, NULL, NULL, NULL, 0, NULL));
+  sendCmd(F("AT+CIPMUX=1"));
 
-  return false;
+  resetSocket(_ptSock);
+  _ptSock = SOCK_NOT_AVAIL;
 }
 
 ////////////////////////////////////////
 
-/**
-   Receive the data into a buffer.
-   It reads up to bufSize bytes.
-   @return  received data size for success else -1.
-*/
-int ESP8266_AT_Drv::getDataBuf(uint8_t connId, uint8_t *buf, uint16_t bufSize)
+bool ESP8266_AT_Drv::passthrough()
 {
-  if (connId != _connId)
-    return false;
-
-  if (_bufPos < bufSize)
-    bufSize = _bufPos;
-
-  for (uint16_t i = 0; i < bufSize; i++)
-  {
-    int c = timedRead();
-    //AT_LOGDEBUG(c);
-
-    if (c == -1)
-      return -1;
+  return _passthrough;
+}
 
-    buf[i] = (char)c;
-    _bufPos--;
-  }
+////////////////////////////////////////
 
-  // KH
-  AT_LOGDEBUG2(F("> getDataBuf:"), bufSize, (char*)buf);
+// Log the refusal of an AT command while in passthrough mode
+bool ESP8266_AT_Drv::passthroughActive()
+{
+  AT_LOGERROR(F("Passthrough mode active, AT command refused"));
 
-  return bufSize;
+  return false;
 }
 
 ////////////////////////////////////////
 
-bool ESP8266_AT_Drv::sendData(uint8_t sock, const uint8_t *data, uint16_t len)
+uint8_t ESP8266_AT_Drv::getServerState(uint8_t sock)
 {
-  AT_LOGDEBUG1(F("AT_Drv::sendData1: socket ="), sock);
-  AT_LOGDEBUG1(F("AT_Drv::sendData1: len ="), len);
-  AT_LOGDEBUG1(F("AT_Drv::sendData1: data ="), (char*) data);
-
-  char cmdBuf[24];
+  ESP_AT_UNUSED(sock);
 
-  // KH, Restore PROGMEM commands
-  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u"), sock, len);
+  return 0;
+}
 
-  espSerial->println(cmdBuf);
+////////////////////////////////////////////////////////////////////////////
+// TCP/IP functions
+////////////////////////////////////////////////////////////////////////////
 
-  int idx = readUntil(1000, (char *)">", false);
+uint16_t ESP8266_AT_Drv::availData(uint8_t connId)
+{
+  // Let queued AT commands run, the serial port belongs to them until they complete
+  poll();
 
-  if (idx != NUMESPTAGS)
-  {
-    AT_LOGDEBUG(F("Data packet send error (1)"));
-    return false;
-  }
+  pumpData();
 
-  espSerial->write(data, len);
+  if (connId >= MAX_SOCK_NUM)
+    return 0;
 
-  idx = readUntil(2000);
+  return _sockRx[connId].available();
+}
 
-  AT_LOGDEBUG1(F("AT_Drv::sendData1: idx ="), idx);
+////////////////////////////////////////
 
-  if (idx != TAG_SENDOK)
-  {
-    AT_LOGDEBUG(F("Data packet send error (2)"));
-    // KH test comment out
-    //return false;
-  }
+int ESP8266_AT_Drv::peekData(uint8_t connId, uint16_t offset)
+{
+  if (connId >= MAX_SOCK_NUM)
+    return -1;
 
-  return true;
+  return _sockRx[connId].peekAt(offset);
 }
 
 ////////////////////////////////////////
 
-// Overrided sendData method for __FlashStringHelper strings
-bool ESP8266_AT_Drv::sendData(uint8_t sock, const __FlashStringHelper *data, uint16_t len, bool appendCrLf)
+bool ESP8266_AT_Drv::getData(uint8_t connId, uint8_t *data, bool peek, bool* connClose)
 {
-  AT_LOGDEBUG2(F("> sendData2:"), sock, len);
-
-  char cmdBuf[24];
-  uint16_t len2 = len + 2 * appendCrLf;
+  *data = 0;
 
-  // KH, Restore PROGMEM commands
-  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u"), sock, len2);
+  if (connId >= MAX_SOCK_NUM)
+    return false;
 
-  espSerial->println(cmdBuf);
+  AT_SocketBuffer& rx = _sockRx[connId];
 
-  int idx = readUntil(1000, (char *)">", false);
+  // see Serial.timedRead
+  unsigned long _startMillis = millis();
 
-  if (idx != NUMESPTAGS)
+  while (rx.available() == 0)
   {
-    AT_LOGDEBUG(F("Data packet send error (1)"));
+    pumpData();
 
-    return false;
-  }
+    if (rx.available())
+      break;
 
-  //espSerial->write(data, len);
-  PGM_P p = reinterpret_cast<PGM_P>(data);
+    if ( (_sockState[connId] == AT_SOCK_CLOSED) || (millis() - _startMillis >= AT_DATA_TIMEOUT) )
+    {
+      AT_LOGDEBUG1(F("ESP8266_AT_Drv::getData: TIMEOUT on socket"), connId);
 
-  for (uint16_t i = 0; i < len; i++)
-  {
-    unsigned char c = pgm_read_byte(p++);
-    espSerial->write(c);
+      return false;
+    }
   }
 
-  if (appendCrLf)
+  if (peek)
   {
-    espSerial->write('\r');
-    espSerial->write('\n');
+    *data = (uint8_t) rx.peek();
   }
-
-  idx = readUntil(2000);
-
-  if (idx != TAG_SENDOK)
+  else
   {
-    AT_LOGDEBUG(F("Data packet send error (2)"));
-    return false;
+    *data = (uint8_t) rx.read();
+
+    if (rx.available() == 0)
+    {
+      pumpData();
 
+      // the "<connId>,CLOSED" line after the last packet means that the socket is now closed
+      *connClose = linkClosed(connId);
+    }
   }
 
   return true;
@@ -1526,26 +1649,938 @@ bool ESP8266_AT_Drv::sendData(uint8_t sock, const __FlashStringHelper *data, uin
 
 ////////////////////////////////////////
 
-bool ESP8266_AT_Drv::sendDataUdp(uint8_t sock, const char* host, uint16_t port, const uint8_t *data, uint16_t len)
+/**
+   Receive the data into a buffer.
+   It copies up to bufSize bytes already received for the socket, waiting only if there are none.
+   @return  received data size for success else -1.
+*/
+int ESP8266_AT_Drv::getDataBuf(uint8_t connId, uint8_t *buf, uint16_t bufSize)
 {
-  AT_LOGDEBUG2(F("> sendDataUdp:"), sock, len);
-  AT_LOGDEBUG2(F("> sendDataUdp:"), host, port);
+  return getDataSpan(connId, buf, bufSize, -1, NULL);
+}
 
-  char cmdBuf[48];
+////////////////////////////////////////
 
-  // KH, Restore PROGMEM commands
-  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u,\"%s\",%u"), sock, len, host, port);
+/**
+   Same as getDataBuf, but stops after the terminator character is read.
+   The terminator is consumed but not copied, and found is set to true.
+   @return  received data size for success else -1.
+*/
+int ESP8266_AT_Drv::getDataUntil(uint8_t connId, char terminator, uint8_t *buf, uint16_t bufSize, bool* found)
+{
+  return getDataSpan(connId, buf, bufSize, (uint8_t) terminator, found);
+}
 
-  //AT_LOGDEBUG1(F("> sendDataUdp:"), cmdBuf);
-  espSerial->println(cmdBuf);
+////////////////////////////////////////
 
-  int idx = readUntil(1000, (char *)">", false);
+int ESP8266_AT_Drv::getDataSpan(uint8_t connId, uint8_t *buf, uint16_t bufSize, int terminator, bool* found)
+{
+  bool hit = false;
 
-  if (idx != NUMESPTAGS)
-  {
-    AT_LOGDEBUG(F("Data packet send error (1)"));
+  if (found)
+    *found = false;
 
-    return false;
+  if (connId >= MAX_SOCK_NUM)
+    return -1;
+
+  AT_SocketBuffer& rx = _sockRx[connId];
+
+  unsigned long _startMillis = millis();
+
+  pumpData();
+
+  while ( (rx.available() == 0) && (bufSize > 0) )
+  {
+    if ( (_sockState[connId] == AT_SOCK_CLOSED) || (millis() - _startMillis >= AT_DATA_TIMEOUT) )
+    {
+      AT_LOGDEBUG1(F("ESP8266_AT_Drv::getDataSpan: TIMEOUT on socket"), connId);
+
+      return -1;
+    }
+
+    pumpData();
+  }
+
+  uint16_t count = 0;
+
+  // Copy what is queued, then what the UART already holds, without waiting for more
+  do
+  {
+    count += rx.read(buf + count, bufSize - count, terminator, &hit);
+
+    if ( hit || (count >= bufSize) )
+      break;
+
+    pumpData();
+  } while (rx.available() > 0);
+
+  if (found)
+    *found = hit;
+
+  AT_LOGDEBUG1(F("> getDataSpan:"), count);
+
+  return count;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::linkClosed(uint8_t connId)
+{
+  return ( (connId < MAX_SOCK_NUM) && (_sockState[connId] == AT_SOCK_CLOSED) && (_sockRx[connId].available() == 0)
+           && (_sockPending[connId] == 0) );
+}
+
+////////////////////////////////////////
+
+/*
+  Move what the module sent outside of AT commands to where it belongs: the payload of each
+  +IPD packet to the receive queue of its socket, parsing the header only once, and the
+  "<connId>,CLOSED" notifications to the socket flags. Never waits for data.
+  A packet bigger than the free space of its queue is left in the UART until the socket is read.
+*/
+void ESP8266_AT_Drv::pumpData()
+{
+  // A running AT command owns the serial port
+  if ( (espSerial == NULL) || (_cmdCurrent >= 0) )
+    return;
+
+  if (_passthrough)
+  {
+    // Raw data of the only connection, no +IPD framing
+    AT_SocketBuffer& rx = _sockRx[_ptSock];
+
+    while ( (rx.free() > 0) && (espSerial->available() > 0) )
+      rx.push((uint8_t) espSerial->read());
+
+    return;
+  }
+
+  while (true)
+  {
+    if (_bufPos > 0)
+    {
+      if (!pumpPayload(false))
+        return;
+
+      continue;
+    }
+
+    if (espSerial->available() <= 0)
+    {
+      if ( (_recvMode == AT_RECV_PASSIVE) && pullPending() )
+        continue;
+
+      return;
+    }
+
+    pumpChar((char) espSerial->read());
+  }
+}
+
+////////////////////////////////////////
+
+// One character outside of +IPD payloads: build the header or notification line
+void ESP8266_AT_Drv::pumpChar(char c)
+{
+  if (c == ':')
+  {
+    _lineBuf[_lineLen] = 0;
+
+    const char* hdr = strstr(_lineBuf, "+IPD,");
+
+    if (hdr != NULL)
+    {
+      startPacket(hdr);
+      _lineLen = 0;
+
+      return;
+    }
+  }
+  else if (c == '\n')
+  {
+    _lineBuf[_lineLen] = 0;
+    handleLine();
+    _lineLen = 0;
+
+    return;
+  }
+  else if (c == '\r')
+  {
+    return;
+  }
+  else if ( (c == '+') && (_lineLen >= AT_LINE_MAX_LEN - 1) )
+  {
+    // garbage without line end, don't miss the header starting here
+    _lineLen = 0;
+  }
+
+  if (_lineLen < AT_LINE_MAX_LEN - 1)
+    _lineBuf[_lineLen++] = c;
+}
+
+////////////////////////////////////////
+
+// format is : +IPD,<ID>,<len>[,<remote IP>,<remote port>]
+void ESP8266_AT_Drv::startPacket(const char* hdr)
+{
+  const char* p = hdr + 5;
+
+  _connId = atoi(p);          // <ID>
+
+  p = strchr(p, ',');
+
+  if (p == NULL)
+    return;
+
+  _bufPos = atol(++p);        // <len>
+
+  parseRemote(p, _remoteIp, &_remotePort);
+
+  _frameMillis = millis();
+
+  AT_LOGDEBUG();
+  AT_LOGDEBUG2(F("Data packet"), _connId, _bufPos);
+
+  if (_connId < MAX_SOCK_NUM)
+  {
+    memcpy(_sockRemoteIp[_connId], _remoteIp, 4);
+    _sockRemotePort[_connId] = _remotePort;
+
+    setSockState(_connId, AT_SOCK_CONNECTED);
+  }
+  else
+  {
+    AT_LOGWARN1(F("No queue for socket, dropping packet"), _connId);
+  }
+}
+
+////////////////////////////////////////
+
+// Parse the optional ,"<remote IP>",<remote port> after p
+void ESP8266_AT_Drv::parseRemote(const char* p, uint8_t* ip, uint16_t* port)
+{
+  p = strchr(p, '"');         // <remote IP>
+
+  if (p == NULL)
+    return;
+
+  for (uint8_t i = 0; (i < 4) && (p != NULL); i++)
+  {
+    ip[i] = atoi(++p);
+    p = strpbrk(p, ".\"");
+  }
+
+  if (p != NULL)
+    p = strchr(p, ',');
+
+  if (p != NULL)
+    *port = atoi(++p);        // <remote port>
+}
+
+////////////////////////////////////////
+
+// Returns false if no progress can be made now.
+// drain: read the payload even if the socket queue is full, losing what doesn't fit
+bool ESP8266_AT_Drv::pumpPayload(bool drain)
+{
+  AT_SocketBuffer* rx = (_connId < MAX_SOCK_NUM) ? &_sockRx[_connId] : NULL;
+
+  if ( (rx != NULL) && (rx->free() == 0) && !drain )
+  {
+    // wait for the reader, not for the module, while the serial port can hold the packet.
+    // Past that, the packet length would count lost bytes and eat the next header or response
+    if ( (AT_SERIAL_RX_HIGH_WATER == 0) || (espSerial->available() < AT_SERIAL_RX_HIGH_WATER) )
+    {
+      _frameMillis = millis();
+
+      return false;
+    }
+
+    AT_LOGWARN1(F("Socket queue full, dropping data of"), _connId);
+
+    rx = NULL;
+  }
+
+  long span = espSerial->available();
+
+  if (span <= 0)
+  {
+    if (millis() - _frameMillis >= AT_DATA_TIMEOUT)
+    {
+      // timed out, drop the rest of the packet
+      AT_LOGDEBUG1(F("ESP8266_AT_Drv::pumpData: TIMEOUT @ bufPos ="), _bufPos);
+
+      _bufPos = 0;
+    }
+
+    return false;
+  }
+
+  if (span > _bufPos)
+    span = _bufPos;
+
+  if ( (rx != NULL) && (span > rx->free()) && !drain )
+    span = rx->free();
+
+  for (long i = 0; i < span; i++)
+  {
+    uint8_t c = (uint8_t) espSerial->read();
+
+    if ( (rx == NULL) || !rx->push(c) )
+      _rxDropped++;
+  }
+
+  if (drain)
+    _rxRescued += span;
+
+  _bufPos -= span;
+  _frameMillis = millis();
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// A complete line from the module, checked for notifications
+void ESP8266_AT_Drv::handleLine()
+{
+  // Passive mode "+IPD,<connId>,<len>[,<remote IP>,<remote port>]": data waiting in the module
+  if (strncmp(_lineBuf, "+IPD,", 5) == 0)
+  {
+    // in active mode the data follows, not a notification
+    if (_recvMode != AT_RECV_PASSIVE)
+      return;
+
+    uint8_t connId = atoi(&_lineBuf[5]);
+    const char* p  = strchr(&_lineBuf[5], ',');
+
+    if ( (connId < MAX_SOCK_NUM) && (p != NULL) )
+    {
+      long pending = _sockPending[connId] + atol(p + 1);
+
+      _sockPending[connId] = (pending > 0xFFFF) ? 0xFFFF : pending;
+
+      setSockState(connId, AT_SOCK_CONNECTED);
+
+      parseRemote(p + 1, _sockRemoteIp[connId], &_sockRemotePort[connId]);
+
+      AT_LOGDEBUG2(F("Data pending"), connId, _sockPending[connId]);
+    }
+
+    return;
+  }
+
+  // "<connId>,CLOSED", "<connId>,CONNECT", "<connId>,CONNECT FAIL"
+  if ( (_lineBuf[0] >= '0') && (_lineBuf[0] < '0' + MAX_SOCK_NUM) && (_lineBuf[1] == ',') )
+  {
+    uint8_t connId = _lineBuf[0] - '0';
+
+    if (strcmp(&_lineBuf[2], "CLOSED") == 0)
+    {
+      AT_LOGDEBUG1(F("Connection closed"), connId);
+      setSockState(connId, AT_SOCK_CLOSED);
+      queueUrc(AT_URC_LINK_CLOSED, connId);
+    }
+    else if (strcmp(&_lineBuf[2], "CONNECT FAIL") == 0)
+    {
+      AT_LOGDEBUG1(F("Connection failed"), connId);
+      setSockState(connId, AT_SOCK_CLOSED);
+      queueUrc(AT_URC_LINK_FAIL, connId);
+    }
+    else if (strcmp(&_lineBuf[2], "CONNECT") == 0)
+    {
+      AT_LOGDEBUG1(F("Connection opened"), connId);
+      setSockState(connId, AT_SOCK_CONNECTED);
+      queueUrc(AT_URC_LINK_CONNECT, connId);
+    }
+
+    return;
+  }
+
+  uint8_t urc = NUM_AT_URC;
+
+  if (strcmp(_lineBuf, "WIFI GOT IP") == 0)
+  {
+    _wifiState       = WL_CONNECTED;
+    _wifiStateMillis = millis();
+    urc              = AT_URC_WIFI_GOT_IP;
+  }
+  else if (strcmp(_lineBuf, "WIFI CONNECTED") == 0)
+  {
+    urc = AT_URC_WIFI_CONNECTED;
+  }
+  else if ( (strcmp(_lineBuf, "WIFI DISCONNECT") == 0) || (strcmp(_lineBuf, "ready") == 0) )
+  {
+    AT_LOGWARN(_lineBuf);
+
+    // the links went down with the Wi-Fi or the module, their CLOSED may never come
+    for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+    {
+      if (_sockState[sock] == AT_SOCK_CONNECTED)
+        setSockState(sock, AT_SOCK_CLOSED);
+    }
+
+    _wifiState       = WL_DISCONNECTED;
+    _wifiStateMillis = millis();
+    urc              = AT_URC_WIFI_DISCONNECT;
+
+    if (_lineBuf[0] == 'r')
+    {
+      // back to the defaults of the module
+      _recvMode    = AT_RECV_ACTIVE;
+      _baudRate    = AT_DEFAULT_BAUD_RATE;
+      _flowControl = false;
+      urc          = AT_URC_READY;
+    }
+  }
+  else if (strncmp(_lineBuf, "busy ", 5) == 0)
+  {
+    AT_LOGDEBUG(_lineBuf);
+    urc = AT_URC_BUSY;
+  }
+  else if (strncmp(_lineBuf, "+STA_CONNECTED:", 15) == 0)
+  {
+    urc = AT_URC_STA_CONNECTED;
+  }
+  else if (strncmp(_lineBuf, "+STA_DISCONNECTED:", 18) == 0)
+  {
+    urc = AT_URC_STA_DISCONNECTED;
+  }
+  else if (strncmp(_lineBuf, "+DIST_STA_IP:", 13) == 0)
+  {
+    urc = AT_URC_STA_IP;
+  }
+
+  if (urc != NUM_AT_URC)
+    queueUrc(urc, SOCK_NOT_AVAIL);
+}
+
+////////////////////////////////////////
+
+// Collect the lines of a command response, to find the URCs mixed with it
+void ESP8266_AT_Drv::feedLine(char c)
+{
+  if (c == '\n')
+  {
+    _lineBuf[_lineLen] = 0;
+    handleLine();
+    _lineLen = 0;
+  }
+  else if ( (c != '\r') && (_lineLen < AT_LINE_MAX_LEN - 1) )
+  {
+    _lineBuf[_lineLen++] = c;
+  }
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Drv::queueUrc(uint8_t urc, uint8_t connId)
+{
+  if (_urcCallback[urc] == NULL)
+    return;
+
+  if (_urcCount >= AT_URC_QUEUE_SIZE)
+  {
+    AT_LOGWARN1(F("URC queue full, dropping"), urc);
+    return;
+  }
+
+  _urcQueue[_urcCount][0] = urc;
+  _urcQueue[_urcCount][1] = connId;
+  _urcCount++;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Drv::dispatchUrc()
+{
+  // a callback's own AT commands call poll() too
+  if ( _urcDispatching || (_urcCount == 0) )
+    return;
+
+  _urcDispatching = true;
+
+  while (_urcCount > 0)
+  {
+    uint8_t urc    = _urcQueue[0][0];
+    uint8_t connId = _urcQueue[0][1];
+
+    _urcCount--;
+    memmove(_urcQueue[0], _urcQueue[1], _urcCount * sizeof(_urcQueue[0]));
+
+    if (_urcCallback[urc] != NULL)
+      _urcCallback[urc](urc, connId);
+  }
+
+  _urcDispatching = false;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Drv::onUrc(uint8_t urc, ATUrcCallback callback)
+{
+  if (urc < NUM_AT_URC)
+    _urcCallback[urc] = callback;
+}
+
+////////////////////////////////////////
+
+// Passive mode: pull data for the sockets the module holds some for. Returns true if any was received
+bool ESP8266_AT_Drv::pullPending()
+{
+  bool got = false;
+
+  for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++)
+  {
+    uint16_t pending = _sockPending[sock];
+    uint16_t free    = _sockRx[sock].free();
+
+    if ( (pending == 0) || (free == 0) )
+      continue;
+
+    // Each pull is a round trip, wait for some room unless the queue is empty
+    if ( (free < pending) && (free < AT_SOCK_RX_BUFFER_SIZE / 4) && (_sockRx[sock].available() > 0) )
+      continue;
+
+    if (pullData(sock) > 0)
+      got = true;
+  }
+
+  return got;
+}
+
+////////////////////////////////////////
+
+/*
+  Passive mode: read into the socket queue as much as it can take, with
+  AT+CIPRECVDATA=<link ID>,<len>
+  The answer differs between firmwares:
+    ESP8266-AT  +CIPRECVDATA,<actual len>:<data>
+    ESP32-AT    +CIPRECVDATA:<actual len>,<"remote IP">,<remote port>,<data>   (AT+CIPDINFO=1)
+  Returns the number of bytes received, -1 on error.
+*/
+int ESP8266_AT_Drv::pullData(uint8_t sock)
+{
+  AT_SocketBuffer& rx = _sockRx[sock];
+  uint16_t len = rx.free();
+
+  char cmdBuf[32];
+
+  sprintf_P(cmdBuf, PSTR("AT+CIPRECVDATA=%d,%u"), sock, len);
+
+  AT_LOGDEBUG1(F(">>"), cmdBuf);
+
+  espSerial->println(cmdBuf);
+
+  int idx = readUntil(1000, "+CIPRECVDATA");
+
+  if (idx != NUMESPTAGS)
+  {
+    // nothing left, or the link is gone
+    AT_LOGDEBUG1(F("No data from AT+CIPRECVDATA, idx ="), idx);
+    _sockPending[sock] = 0;
+
+    return -1;
+  }
+
+  // ',' or ':' then the length
+  timedRead();
+
+  int c = timedRead();
+  long actual = timedReadNumber(c);
+
+  if (c == ',')
+  {
+    // [<"remote IP">,<remote port>] before the data
+    c = timedRead();
+
+    if (c == '"')
+      c = timedRead();
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+      _sockRemoteIp[sock][i] = timedReadNumber(c);
+
+      if (c == '.')
+        c = timedRead();
+    }
+
+    if (c == '"')
+      timedRead();
+
+    // the separator after the port is consumed too
+    c = timedRead();
+    _sockRemotePort[sock] = timedReadNumber(c);
+  }
+
+  if (actual > len)
+    actual = len;
+
+  long count = 0;
+
+  while ( (count < actual) && ((c = timedRead()) >= 0) )
+  {
+    rx.push((uint8_t) c);
+    count++;
+  }
+
+  // read the remaining part of the response
+  readUntil(1000);
+
+  AT_LOGDEBUG2(F("Pulled data"), sock, count);
+
+  if (actual < len)
+  {
+    // the module gave all it had
+    _sockPending[sock] = 0;
+  }
+  else if (_sockPending[sock] > actual)
+  {
+    _sockPending[sock] -= actual;
+  }
+  else
+  {
+    // lost notifications or more received since, ask
+    syncRecvLen();
+  }
+
+  return count;
+}
+
+////////////////////////////////////////
+
+// Passive mode: refresh the pending lengths from AT+CIPRECVLEN?, "+CIPRECVLEN:<len0>,<len1>,..."
+void ESP8266_AT_Drv::syncRecvLen()
+{
+  char buf[40];
+
+  memset(buf, 0, sizeof(buf));
+
+  if (!sendCmdGet(F("AT+CIPRECVLEN?"), F("+CIPRECVLEN:"), F("\r\n"), buf, sizeof(buf)))
+    return;
+
+  char* p = buf;
+
+  for (uint8_t sock = 0; (sock < MAX_SOCK_NUM) && (p != NULL); sock++)
+  {
+    long pending = atol(p);
+
+    _sockPending[sock] = (pending > 0xFFFF) ? 0xFFFF : ( (pending < 0) ? 0 : pending );
+
+    p = strchr(p, ',');
+
+    if (p != NULL)
+      p++;
+  }
+}
+
+////////////////////////////////////////
+
+uint8_t ESP8266_AT_Drv::recvMode()
+{
+  return _recvMode;
+}
+
+////////////////////////////////////////
+
+// Forget what was received for a socket, when it is (re)opened or closed by us
+void ESP8266_AT_Drv::resetSocket(uint8_t sock)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return;
+
+  _sockRx[sock].clear();
+  _sockState[sock]   = AT_SOCK_UNKNOWN;
+  _sockPending[sock] = 0;
+
+  if (_connId == sock)
+    _bufPos = 0;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Drv::setSockState(uint8_t sock, uint8_t state)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return;
+
+  _sockState[sock]       = state;
+  _sockStateMillis[sock] = millis();
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::sendData(uint8_t sock, const uint8_t *data, uint16_t len)
+{
+  AT_LOGDEBUG1(F("AT_Drv::sendData1: socket ="), sock);
+  AT_LOGDEBUG1(F("AT_Drv::sendData1: len ="), len);
+  AT_LOGDEBUG1(F("AT_Drv::sendData1: data ="), (char*) data);
+
+  if (_passthrough)
+  {
+    // Straight to the connection, the module sends it on its own
+    if (sock != _ptSock)
+      return passthroughActive();
+
+    espSerial->write(data, len);
+
+    return true;
+  }
+
+  char cmdBuf[24];
+
+  // The module answers one command at a time
+  waitCmdIdle();
+  // keep the data received meanwhile out of the answer
+  espEmptyBuf(false);
+
+  // KH, Restore PROGMEM commands
+  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u"), sock, len);
+
+  espSerial->println(cmdBuf);
+
+  int idx = readPrompt(1000);
+
+  if (idx != NUMESPTAGS)
+  {
+    AT_LOGDEBUG(F("Data packet send error (1)"));
+    return false;
+  }
+
+  espSerial->write(data, len);
+
+  idx = readUntil(2000);
+
+  AT_LOGDEBUG1(F("AT_Drv::sendData1: idx ="), idx);
+
+  if (idx != TAG_SENDOK)
+  {
+    AT_LOGDEBUG(F("Data packet send error (2)"));
+    // KH test comment out
+    //return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+// Overrided sendData method for __FlashStringHelper strings
+bool ESP8266_AT_Drv::sendData(uint8_t sock, const __FlashStringHelper *data, uint16_t len, bool appendCrLf)
+{
+  AT_LOGDEBUG2(F("> sendData2:"), sock, len);
+
+  char cmdBuf[24];
+  uint16_t len2 = len + 2 * appendCrLf;
+  int idx;
+
+  if (!_passthrough)
+  {
+    // The module answers one command at a time
+    waitCmdIdle();
+    // keep the data received meanwhile out of the answer
+    espEmptyBuf(false);
+
+    // KH, Restore PROGMEM commands
+    sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u"), sock, len2);
+
+    espSerial->println(cmdBuf);
+
+    idx = readPrompt(1000);
+
+    if (idx != NUMESPTAGS)
+    {
+      AT_LOGDEBUG(F("Data packet send error (1)"));
+
+      return false;
+    }
+  }
+  else if (sock != _ptSock)
+  {
+    return passthroughActive();
+  }
+
+  //espSerial->write(data, len);
+  PGM_P p = reinterpret_cast<PGM_P>(data);
+
+  for (uint16_t i = 0; i < len; i++)
+  {
+    unsigned char c = pgm_read_byte(p++);
+    espSerial->write(c);
+  }
+
+  if (appendCrLf)
+  {
+    espSerial->write('\r');
+    espSerial->write('\n');
+  }
+
+  if (_passthrough)
+    return true;
+
+  idx = readUntil(2000);
+
+  if (idx != TAG_SENDOK)
+  {
+    AT_LOGDEBUG(F("Data packet send error (2)"));
+    return false;
+
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::sendDataV(uint8_t sock, const ATIoVec* iov, uint8_t count, size_t offset, uint16_t len)
+{
+  AT_LOGDEBUG2(F("> sendDataV:"), sock, len);
+
+  if (_passthrough)
+  {
+    if (sock != _ptSock)
+      return passthroughActive();
+
+    writeIoVec(iov, count, offset, len);
+
+    return true;
+  }
+
+  char cmdBuf[24];
+
+  // The module answers one command at a time
+  waitCmdIdle();
+  // keep the data received meanwhile out of the answer
+  espEmptyBuf(false);
+
+  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u"), sock, len);
+
+  espSerial->println(cmdBuf);
+
+  int idx = readPrompt(1000);
+
+  if (idx != NUMESPTAGS)
+  {
+    AT_LOGDEBUG1(F("Data packet send error (1)"), idx);
+
+    _lastSendResult = idx;
+
+    return false;
+  }
+
+  _lastSendResult = AT_CMD_OK;
+
+  writeIoVec(iov, count, offset, len);
+
+  idx = readUntil(2000);
+
+  // As sendData(): the data is gone, sending it again would duplicate it
+  if (idx != TAG_SENDOK)
+  {
+    AT_LOGDEBUG(F("Data packet send error (2)"));
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+int ESP8266_AT_Drv::lastSendResult()
+{
+  return _lastSendResult;
+}
+
+////////////////////////////////////////
+
+// Wait for the ">" prompt of AT+CIPSEND, skipping the OK before it and the tags of notifications
+// like "n,CONNECT" or a late "SEND OK": the module may still be waiting for the data.
+// Returns NUMESPTAGS, or the tag ending the wait early: ERROR or "busy s..."
+int ESP8266_AT_Drv::readPrompt(unsigned int timeout)
+{
+  readBegin(">", true);
+
+  unsigned long start = millis();
+
+  while (millis() - start < timeout)
+  {
+    if (espSerial->available() <= 0)
+      continue;
+
+    int ret = readFeed((char) espSerial->read());
+
+    if ( (ret == NUMESPTAGS) || (ret == TAG_ERROR) || (ret == TAG_BUSY) )
+      return ret;
+  }
+
+  AT_LOGWARN(F(">>> TIMEOUT >>>"));
+
+  return -1;
+}
+
+////////////////////////////////////////
+
+void ESP8266_AT_Drv::writeIoVec(const ATIoVec* iov, uint8_t count, size_t offset, uint16_t len)
+{
+  for (uint8_t i = 0; (i < count) && (len > 0); i++)
+  {
+    if (offset >= iov[i].len)
+    {
+      offset -= iov[i].len;
+      continue;
+    }
+
+    size_t n = iov[i].len - offset;
+
+    if (n > len)
+      n = len;
+
+    const uint8_t* p = (const uint8_t*) iov[i].data + offset;
+
+    if (iov[i].progmem)
+    {
+      for (size_t k = 0; k < n; k++)
+        espSerial->write(pgm_read_byte(p + k));
+    }
+    else
+    {
+      espSerial->write(p, n);
+    }
+
+    len   -= n;
+    offset = 0;
+  }
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::sendDataUdp(uint8_t sock, const char* host, uint16_t port, const uint8_t *data, uint16_t len)
+{
+  AT_LOGDEBUG2(F("> sendDataUdp:"), sock, len);
+  AT_LOGDEBUG2(F("> sendDataUdp:"), host, port);
+
+  char cmdBuf[48];
+
+  if (_passthrough)
+    return passthroughActive();
+
+  // The module answers one command at a time
+  waitCmdIdle();
+  // keep the data received meanwhile out of the answer
+  espEmptyBuf(false);
+
+  // KH, Restore PROGMEM commands
+  sprintf_P(cmdBuf, PSTR("AT+CIPSEND=%d,%u,\"%s\",%u"), sock, len, host, port);
+
+  //AT_LOGDEBUG1(F("> sendDataUdp:"), cmdBuf);
+  espSerial->println(cmdBuf);
+
+  int idx = readPrompt(1000);
+
+  if (idx != NUMESPTAGS)
+  {
+    AT_LOGDEBUG(F("Data packet send error (1)"));
+
+    return false;
   }
 
   espSerial->write(data, len);
@@ -1578,6 +2613,27 @@ uint16_t ESP8266_AT_Drv::getRemotePort()
   return _remotePort;
 }
 
+////////////////////////////////////////
+
+// Sender of the last packet received for this socket
+void ESP8266_AT_Drv::getRemoteIpAddress(uint8_t sock, IPAddress& ip)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return;
+
+  ip = IPAddress(_sockRemoteIp[sock][0], _sockRemoteIp[sock][1], _sockRemoteIp[sock][2], _sockRemoteIp[sock][3]);
+}
+
+////////////////////////////////////////
+
+uint16_t ESP8266_AT_Drv::getRemotePort(uint8_t sock)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return 0;
+
+  return _sockRemotePort[sock];
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // Utility functions for String
 ////////////////////////////////////////////////////////////////////////////
@@ -1589,273 +2645,532 @@ uint16_t ESP8266_AT_Drv::getRemotePort()
 */
 bool ESP8266_AT_Drv::sendCmdGet(const char* cmd, const char* startTag, const char* endTag, char* outStr, int outStrLen)
 {
-  int idx;
-  bool ret = false;
+  outStr[0] = 0;
+
+  // The caller's buffers outlive the command as we wait for it here
+  return (waitCmd(queueCmd(cmd, false, 1000, startTag, endTag, outStr, outStrLen, NULL)) == NUMESPTAGS);
+}
+
+////////////////////////////////////////
+
+#if 0
+bool ESP8266_AT_Drv::sendCmdGet(const char* cmd, const char* startTag, const char* endTag, char* outStr, int outStrLen)
+{
+  char _startTag[strlen((char*)startTag) + 1];
+  strcpy(_startTag,  (char*)startTag);
+
+  char _endTag[strlen((char*)endTag) + 1];
+  strcpy(_endTag,  (char*)endTag);
+
+  return sendCmdGet(cmd, _startTag, _endTag, outStr, outStrLen);
+}
+#endif
+
+////////////////////////////////////////
+
+/*
+  Sends the AT command and returns the id of the TAG.
+  Return -1 if no tag is found.
+*/
+int ESP8266_AT_Drv::sendCmd(const char* cmd, int timeout)
+{
+  return waitCmd(queueCmd(cmd, false, timeout, NULL, NULL, NULL, 0, NULL));
+}
+
+////////////////////////////////////////
+
+/*
+  Sends the AT command and returns the id of the TAG.
+  The additional arguments are formatted into the command using sprintf.
+  Return -1 if no tag is found.
+*/
+int ESP8266_AT_Drv::sendCmd(const char* cmd, int timeout, ...)
+{
+  char cmdBuf[CMD_BUFFER_SIZE];
+
+  va_list args;
+  va_start (args, timeout);
+
+  vsnprintf (cmdBuf, CMD_BUFFER_SIZE, (char*)cmd, args);
+
+  va_end (args);
+
+  return waitCmd(queueCmd(cmdBuf, false, timeout, NULL, NULL, NULL, 0, NULL));
+}
+
+// KH, Restore PROGMEM commands
+
+////////////////////////////////////////////////////////////////////////////
+// Utility functions for __FlashStringHelper
+////////////////////////////////////////////////////////////////////////////
+
+/*
+  Sends the AT command and stops if any of the TAGS is found.
+  Extract the string enclosed in the passed tags and returns it in the outStr buffer.
+  Returns true if the string is extracted, false if tags are not found of timed out.
+*/
+bool ESP8266_AT_Drv::sendCmdGet(const __FlashStringHelper* cmd, const char* startTag, const char* endTag, char* outStr,
+                                int outStrLen)
+{
+  outStr[0] = 0;
+
+  return (waitCmd(queueCmd((const char*) cmd, true, 1000, startTag, endTag, outStr, outStrLen, NULL)) == NUMESPTAGS);
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::sendCmdGet(const __FlashStringHelper* cmd, const __FlashStringHelper* startTag,
+                                const __FlashStringHelper* endTag, char* outStr, int outStrLen)
+{
+  char _startTag[strlen_P((char*)startTag) + 1];
+  strcpy_P(_startTag,  (char*)startTag);
+
+  char _endTag[strlen_P((char*)endTag) + 1];
+  strcpy_P(_endTag,  (char*)endTag);
+
+  return sendCmdGet(cmd, _startTag, _endTag, outStr, outStrLen);
+}
+
+////////////////////////////////////////
+
+/*
+  Sends the AT command and returns the id of the TAG.
+  Return -1 if no tag is found.
+*/
+int ESP8266_AT_Drv::sendCmd(const __FlashStringHelper* cmd, int timeout)
+{
+  return waitCmd(queueCmd((const char*) cmd, true, timeout, NULL, NULL, NULL, 0, NULL));
+}
+
+////////////////////////////////////////
+
+/*
+  Sends the AT command and returns the id of the TAG.
+  The additional arguments are formatted into the command using sprintf.
+  Return -1 if no tag is found.
+*/
+int ESP8266_AT_Drv::sendCmd(const __FlashStringHelper* cmd, int timeout, ...)
+{
+  char cmdBuf[CMD_BUFFER_SIZE];
+
+  va_list args;
+  va_start (args, timeout);
+
+  vsnprintf_P (cmdBuf, CMD_BUFFER_SIZE, (char*)cmd, args);
+
+  va_end (args);
+
+  return waitCmd(queueCmd(cmdBuf, false, timeout, NULL, NULL, NULL, 0, NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Asynchronous AT commands
+////////////////////////////////////////////////////////////////////////////
+
+int8_t ESP8266_AT_Drv::sendCmdAsync(const __FlashStringHelper* cmd, unsigned int timeout, ATCmdCallback callback)
+{
+  if (freeCmdSlot(false) < 0)
+    return -1;
+
+  return queueCmd((const char*) cmd, true, timeout, NULL, NULL, NULL, 0, callback);
+}
+
+////////////////////////////////////////
+
+int8_t ESP8266_AT_Drv::sendCmdAsync(const char* cmd, unsigned int timeout, ATCmdCallback callback)
+{
+  if (freeCmdSlot(false) < 0)
+    return -1;
+
+  // The caller's string may be gone by the time the command is sent
+  char* copy = new char[strlen(cmd) + 1];
+
+  if (copy == NULL)
+    return -1;
+
+  strcpy(copy, cmd);
+
+  int8_t id = queueCmd(copy, false, timeout, NULL, NULL, NULL, 0, callback);
+
+  if (id < 0)
+  {
+    delete[] copy;
+    return -1;
+  }
+
+  _cmdQueue[id].ownsCmd = true;
+
+  return id;
+}
+
+////////////////////////////////////////
+
+int ESP8266_AT_Drv::cmdResult(int8_t cmdId)
+{
+  if ( (cmdId < 0) || (cmdId >= AT_CMD_QUEUE_SIZE) || (_cmdQueue[cmdId].state == AT_CMD_FREE) )
+    return AT_CMD_TIMEOUT;
+
+  if (_cmdQueue[cmdId].state != AT_CMD_DONE)
+    return AT_CMD_PENDING;
+
+  int result = _cmdQueue[cmdId].result;
+
+  releaseCmd(cmdId);
+
+  return result;
+}
+
+////////////////////////////////////////
+
+bool ESP8266_AT_Drv::cmdPending(int8_t cmdId)
+{
+  return ( (cmdId >= 0) && (cmdId < AT_CMD_QUEUE_SIZE) && (_cmdQueue[cmdId].state == AT_CMD_QUEUED
+                                                             || _cmdQueue[cmdId].state == AT_CMD_SENT) );
+}
+
+////////////////////////////////////////
+
+int8_t ESP8266_AT_Drv::wifiConnectAsync(const char* ssid, const char* passphrase, ATCmdCallback callback)
+{
+  AT_LOGDEBUG(F("> wifiConnectAsync"));
+
+  char cmdBuf[CMD_BUFFER_SIZE];
+
+  if (useESP32_AT)
+  {
+    AT_LOGINFO2(F("AT+CWJAP="), ssid, passphrase);
+    snprintf_P(cmdBuf, CMD_BUFFER_SIZE, PSTR("AT+CWJAP=\"%s\",\"%s\""), ssid, passphrase);
+  }
+  else
+  {
+    AT_LOGINFO2(F("AT+CWJAP_CUR="), ssid, passphrase);
+    snprintf_P(cmdBuf, CMD_BUFFER_SIZE, PSTR("AT+CWJAP_CUR=\"%s\",\"%s\""), ssid, passphrase);
+  }
+
+  return sendCmdAsync(cmdBuf, 20000, callback);
+}
+
+////////////////////////////////////////
+
+/*
+  Advance the command queue: send the next command when the module is idle,
+  then feed it whatever the module has answered so far.
+  Only one command is on the wire at a time, so the responses can't interleave.
+*/
+void ESP8266_AT_Drv::poll()
+{
+  if (espSerial == NULL)
+    return;
 
-  outStr[0] = 0;
+  if (_cmdCurrent < 0)
+  {
+    // between commands, so the callbacks can send their own
+    dispatchUrc();
 
-  espEmptyBuf();
+    // Don't send a command in the middle of an +IPD packet, its response would be mixed with the data
+    if ( (_bufPos > 0) || !startNextCmd() )
+      return;
+  }
 
-  AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmd);
+  ATCommand& cmd = _cmdQueue[_cmdCurrent];
 
-  // send AT command to ESP
-  espSerial->println(cmd);
+  int ret = -1;
 
-  // read result until the startTag is found
-  idx = readUntil(1000, startTag);
+  while ( (ret < 0) && espSerial->available() )
+  {
+    ret = readFeed((char) espSerial->read());
+  }
 
-  if (idx == NUMESPTAGS)
+  if (ret < 0)
   {
-    // clean the buffer to get a clean string
-    ringBuf.init();
+    if (millis() - cmd.start < cmd.timeout)
+      return;
 
-    // start tag found, search the endTag
-    idx = readUntil(500, endTag);
+    AT_LOGWARN(F(">>> TIMEOUT >>>"));
+  }
 
-    if (idx == NUMESPTAGS)
+  if (cmd.startTag == NULL)
+  {
+    finishCmd(ret);
+    return;
+  }
+
+  // sendCmdGet: startTag, then endTag, then the rest of the response
+  if (cmd.phase == 0)
+  {
+    if (ret == NUMESPTAGS)
     {
-      // end tag found
-      // copy result to output buffer avoiding overflow
-      ringBuf.getStrN(outStr, strlen(endTag), outStrLen - 1);
+      // clean the buffer to get a clean string
+      ringBuf.init();
 
-      // read the remaining part of the response
-      readUntil(2000);
+      // start tag found, search the endTag
+      readBegin(cmd.endTag, true);
 
-      ret = true;
+      cmd.phase   = 1;
+      cmd.timeout = 500;
+      cmd.start   = millis();
+
+      return;
+    }
+    else if (ret >= 0)
+    {
+      // the command has returned but no start tag is found
+      AT_LOGDEBUG1(F("No start tag found:"), ret);
     }
     else
     {
-      AT_LOGWARN(F("End tag not found"));
+      // the command has returned but no tag is found
+      AT_LOGWARN(F("No tag found"));
     }
+
+    finishCmd(ret);
   }
-  else if (idx >= 0 and idx < NUMESPTAGS)
+  else if (cmd.phase == 1)
   {
-    // the command has returned but no start tag is found
-    AT_LOGDEBUG1(F("No start tag found:"), idx);
+    if (ret == NUMESPTAGS)
+    {
+      // end tag found
+      // copy result to output buffer avoiding overflow
+      ringBuf.getStrN(cmd.outStr, strlen(cmd.endTag), cmd.outStrLen - 1);
+
+      // read the remaining part of the response
+      readBegin(NULL, true);
+
+      cmd.phase   = 2;
+      cmd.timeout = 2000;
+      cmd.start   = millis();
+
+      return;
+    }
+
+    AT_LOGWARN(F("End tag not found"));
+
+    finishCmd(ret);
   }
   else
   {
-    // the command has returned but no tag is found
-    AT_LOGWARN(F("No tag found"));
+    // the string was extracted, whatever ends the response
+    finishCmd(NUMESPTAGS);
   }
-
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), outStr);
-  AT_LOGDEBUG();
-
-  return ret;
 }
 
 ////////////////////////////////////////
 
-#if 0
-bool ESP8266_AT_Drv::sendCmdGet(const char* cmd, const char* startTag, const char* endTag, char* outStr, int outStrLen)
+int8_t ESP8266_AT_Drv::queueCmd(const char* cmd, bool progmem, unsigned int timeout, const char* startTag,
+                                const char* endTag, char* outStr, int outStrLen, ATCmdCallback callback)
 {
-  char _startTag[strlen((char*)startTag) + 1];
-  strcpy(_startTag,  (char*)startTag);
+  // The module would send the command as data
+  if (_passthrough)
+  {
+    passthroughActive();
+    return -1;
+  }
 
-  char _endTag[strlen((char*)endTag) + 1];
-  strcpy(_endTag,  (char*)endTag);
+  int8_t id = freeCmdSlot(true);
 
-  return sendCmdGet(cmd, _startTag, _endTag, outStr, outStrLen);
+  ATCommand& entry = _cmdQueue[id];
+
+  entry.cmd       = cmd;
+  entry.progmem   = progmem;
+  entry.ownsCmd   = false;
+  entry.state     = AT_CMD_QUEUED;
+  entry.phase     = 0;
+  entry.seq       = _cmdSeq++;
+  entry.result    = AT_CMD_TIMEOUT;
+  entry.timeout   = timeout;
+  entry.startTag  = startTag;
+  entry.endTag    = endTag;
+  entry.outStr    = outStr;
+  entry.outStrLen = outStrLen;
+  entry.callback  = callback;
+
+  return id;
 }
-#endif
 
 ////////////////////////////////////////
 
-/*
-  Sends the AT command and returns the id of the TAG.
-  Return -1 if no tag is found.
-*/
-int ESP8266_AT_Drv::sendCmd(const char* cmd, int timeout)
+// Find a free slot, or free the oldest result not collected. If wait, keep the queue running until one is released
+int8_t ESP8266_AT_Drv::freeCmdSlot(bool wait)
 {
-  espEmptyBuf();
+  while (true)
+  {
+    int8_t oldestDone = -1;
+    bool   busy       = false;
 
-  AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmd);
+    for (int8_t i = 0; i < AT_CMD_QUEUE_SIZE; i++)
+    {
+      if (_cmdQueue[i].state == AT_CMD_FREE)
+        return i;
+
+      if (_cmdQueue[i].state == AT_CMD_DONE)
+      {
+        if ( (oldestDone < 0) || ((uint8_t) (_cmdQueue[i].seq - _cmdQueue[oldestDone].seq) > 127) )
+          oldestDone = i;
+      }
+      else
+        busy = true;
+    }
 
-  espSerial->println(cmd);
+    // Results nobody collected, drop the oldest one. A waiting caller lets the running commands finish first
+    if ( (oldestDone >= 0) && (!wait || !busy) )
+    {
+      AT_LOGDEBUG1(F("Drop uncollected AT command result"), oldestDone);
+      releaseCmd(oldestDone);
 
-  int idx = readUntil(timeout);
+      return oldestDone;
+    }
 
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), idx);
-  AT_LOGDEBUG();
+    if (!wait)
+      return -1;
+
+    if (_cmdCurrent < 0)
+    {
+      // A synchronous caller can't wait for the reader of a half-read +IPD packet
+      espEmptyBuf(false);
+    }
 
-  return idx;
+    poll();
+  }
 }
 
 ////////////////////////////////////////
 
-/*
-  Sends the AT command and returns the id of the TAG.
-  The additional arguments are formatted into the command using sprintf.
-  Return -1 if no tag is found.
-*/
-int ESP8266_AT_Drv::sendCmd(const char* cmd, int timeout, ...)
+void ESP8266_AT_Drv::releaseCmd(int8_t cmdId)
 {
-  char cmdBuf[CMD_BUFFER_SIZE];
+  ATCommand& entry = _cmdQueue[cmdId];
 
-  va_list args;
-  va_start (args, timeout);
-
-  vsnprintf (cmdBuf, CMD_BUFFER_SIZE, (char*)cmd, args);
-
-  va_end (args);
-
-  espEmptyBuf();
+  if (entry.ownsCmd)
+    delete[] entry.cmd;
 
-  AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmdBuf);
-
-  espSerial->println(cmdBuf);
-
-  int idx = readUntil(timeout);
+  entry.cmd     = NULL;
+  entry.ownsCmd = false;
+  entry.state   = AT_CMD_FREE;
+}
 
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), idx);
-  AT_LOGDEBUG();
+////////////////////////////////////////
 
-  return idx;
-}
+bool ESP8266_AT_Drv::startNextCmd()
+{
+  int8_t id = -1;
 
-// KH, Restore PROGMEM commands
+  // Oldest queued command first
+  for (int8_t i = 0; i < AT_CMD_QUEUE_SIZE; i++)
+  {
+    if (_cmdQueue[i].state != AT_CMD_QUEUED)
+      continue;
 
-////////////////////////////////////////////////////////////////////////////
-// Utility functions for __FlashStringHelper
-////////////////////////////////////////////////////////////////////////////
+    if ( (id < 0) || ((uint8_t) (_cmdQueue[i].seq - _cmdQueue[id].seq) > 127) )
+      id = i;
+  }
 
-/*
-  Sends the AT command and stops if any of the TAGS is found.
-  Extract the string enclosed in the passed tags and returns it in the outStr buffer.
-  Returns true if the string is extracted, false if tags are not found of timed out.
-*/
-bool ESP8266_AT_Drv::sendCmdGet(const __FlashStringHelper* cmd, const char* startTag, const char* endTag, char* outStr,
-                                int outStrLen)
-{
-  int idx;
-  bool ret = false;
+  if (id < 0)
+    return false;
 
-  outStr[0] = 0;
+  ATCommand& cmd = _cmdQueue[id];
 
   espEmptyBuf();
 
   AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmd);
 
   // send AT command to ESP
-  espSerial->println(cmd);
+  if (cmd.progmem)
+  {
+    AT_LOGDEBUG1(F(">>"), (const __FlashStringHelper*) cmd.cmd);
+    espSerial->println((const __FlashStringHelper*) cmd.cmd);
+  }
+  else
+  {
+    AT_LOGDEBUG1(F(">>"), cmd.cmd);
+    espSerial->println(cmd.cmd);
+  }
 
-  // read result until the startTag is found
-  idx = readUntil(1000, startTag);
+  // read result until the startTag, if any, is found
+  readBegin(cmd.startTag, true);
 
-  if (idx == NUMESPTAGS)
-  {
-    // clean the buffer to get a clean string
-    ringBuf.init();
+  cmd.state   = AT_CMD_SENT;
+  cmd.start   = millis();
+  _cmdCurrent = id;
 
-    // start tag found, search the endTag
-    idx = readUntil(500, endTag);
+  return true;
+}
 
-    if (idx == NUMESPTAGS)
-    {
-      // end tag found
-      // copy result to output buffer avoiding overflow
-      ringBuf.getStrN(outStr, strlen(endTag), outStrLen - 1);
+////////////////////////////////////////
 
-      // read the remaining part of the response
-      readUntil(2000);
+void ESP8266_AT_Drv::finishCmd(int result)
+{
+  int8_t id = _cmdCurrent;
+  ATCommand& cmd = _cmdQueue[id];
 
-      ret = true;
-    }
-    else
-    {
-      AT_LOGWARN(F("End tag not found"));
-    }
-  }
-  else if (idx >= 0 and idx < NUMESPTAGS)
+  if (cmd.outStr)
   {
-    // the command has returned but no start tag is found
-    AT_LOGDEBUG1(F("No start tag found:"), idx);
+    AT_LOGDEBUG1(F("---------------------------------------------- >"), cmd.outStr);
   }
   else
   {
-    // the command has returned but no tag is found
-    AT_LOGWARN(F("No tag found"));
+    AT_LOGDEBUG1(F("---------------------------------------------- >"), result);
   }
 
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), outStr);
   AT_LOGDEBUG();
 
-  return ret;
-}
-
-////////////////////////////////////////
-
-bool ESP8266_AT_Drv::sendCmdGet(const __FlashStringHelper* cmd, const __FlashStringHelper* startTag,
-                                const __FlashStringHelper* endTag, char* outStr, int outStrLen)
-{
-  char _startTag[strlen_P((char*)startTag) + 1];
-  strcpy_P(_startTag,  (char*)startTag);
+  cmd.result  = result;
+  cmd.state   = AT_CMD_DONE;
+  _cmdCurrent = -1;
 
-  char _endTag[strlen_P((char*)endTag) + 1];
-  strcpy_P(_endTag,  (char*)endTag);
+  if (cmd.callback)
+  {
+    ATCmdCallback callback = cmd.callback;
 
-  return sendCmdGet(cmd, _startTag, _endTag, outStr, outStrLen);
+    // Release first, so that the callback can queue the next command
+    releaseCmd(id);
+    callback(id, result);
+  }
 }
 
 ////////////////////////////////////////
 
-/*
-  Sends the AT command and returns the id of the TAG.
-  Return -1 if no tag is found.
-*/
-int ESP8266_AT_Drv::sendCmd(const __FlashStringHelper* cmd, int timeout)
+int ESP8266_AT_Drv::waitCmd(int8_t cmdId)
 {
-  espEmptyBuf();
+  if (cmdId < 0)
+    return AT_CMD_ERROR;
 
-  AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmd);
-
-  espSerial->println(cmd);
+  // A command with a callback is released on completion, its slot may be reused by then
+  if (_cmdQueue[cmdId].callback)
+    return AT_CMD_ERROR;
 
-  int idx = readUntil(timeout);
+  while ( (_cmdQueue[cmdId].state != AT_CMD_DONE) && (_cmdQueue[cmdId].state != AT_CMD_FREE) )
+  {
+    if (_cmdCurrent < 0)
+    {
+      // A synchronous caller can't wait for the reader of a half-read +IPD packet
+      espEmptyBuf(false);
+    }
 
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), idx);
-  AT_LOGDEBUG();
+    poll();
+  }
 
-  return idx;
+  return cmdResult(cmdId);
 }
 
 ////////////////////////////////////////
 
-/*
-  Sends the AT command and returns the id of the TAG.
-  The additional arguments are formatted into the command using sprintf.
-  Return -1 if no tag is found.
-*/
-int ESP8266_AT_Drv::sendCmd(const __FlashStringHelper* cmd, int timeout, ...)
+// Complete all queued commands before using the serial port directly
+void ESP8266_AT_Drv::waitCmdIdle()
 {
-  char cmdBuf[CMD_BUFFER_SIZE];
-
-  va_list args;
-  va_start (args, timeout);
-
-  vsnprintf_P (cmdBuf, CMD_BUFFER_SIZE, (char*)cmd, args);
-
-  va_end (args);
-
-  espEmptyBuf();
-
-  AT_LOGDEBUG(F("----------------------------------------------"));
-  AT_LOGDEBUG1(F(">>"), cmdBuf);
+  while (true)
+  {
+    bool busy = (_cmdCurrent >= 0);
 
-  espSerial->println(cmdBuf);
+    for (int8_t i = 0; !busy && (i < AT_CMD_QUEUE_SIZE); i++)
+      busy = (_cmdQueue[i].state == AT_CMD_QUEUED);
 
-  int idx = readUntil(timeout);
+    if (!busy)
+      return;
 
-  AT_LOGDEBUG1(F("---------------------------------------------- >"), idx);
-  AT_LOGDEBUG();
+    if (_cmdCurrent < 0)
+      espEmptyBuf(false);
 
-  return idx;
+    poll();
+  }
 }
 
 ////////////////////////////////////////
@@ -1866,9 +3181,8 @@ int ESP8266_AT_Drv::sendCmd(const __FlashStringHelper* cmd, int timeout, ...)
 //   -1 if no tag was found (timeout)
 int ESP8266_AT_Drv::readUntil(unsigned int timeout, const char* tag, bool findTags)
 {
-  ringBuf.reset();
+  readBegin(tag, findTags);
 
-  char c;
   unsigned long start = millis();
   int ret = -1;
 
@@ -1878,31 +3192,7 @@ int ESP8266_AT_Drv::readUntil(unsigned int timeout, const char* tag, bool findTa
   {
     if (espSerial->available())
     {
-      c = (char)espSerial->read();
-
-      AT_LOGDEBUG0(c);
-
-      ringBuf.push(c);
-
-      if (tag != NULL)
-      {
-        if (ringBuf.endsWith(tag))
-        {
-          ret = NUMESPTAGS;
-        }
-      }
-
-      if (findTags)
-      {
-        for (int i = 0; i < NUMESPTAGS; i++)
-        {
-          if (ringBuf.endsWith(ESPTAGS[i]))
-          {
-            ret = i;
-            break;
-          }
-        }
-      }
+      ret = readFeed((char)espSerial->read());
     }
   }
 
@@ -1916,30 +3206,119 @@ int ESP8266_AT_Drv::readUntil(unsigned int timeout, const char* tag, bool findTa
 
 ////////////////////////////////////////
 
+void ESP8266_AT_Drv::readBegin(const char* tag, bool findTags)
+{
+  ringBuf.reset();
+
+  _readSlowTag = tagMatcher.begin(tag, findTags) ? NULL : tag;
+}
+
+////////////////////////////////////////
+
+// Push one character of the response.
+// Returns the index of the tag it completes, NUMESPTAGS for the readBegin() tag, or -1
+int ESP8266_AT_Drv::readFeed(char c)
+{
+  AT_LOGDEBUG0(c);
+
+  ringBuf.push(c);
+
+  // URCs can arrive in the middle of a response
+  feedLine(c);
+
+  int ret = tagMatcher.push(c);
+
+  if ( (ret < 0) && (_readSlowTag != NULL) && ringBuf.endsWith(_readSlowTag) )
+  {
+    ret = NUMESPTAGS;
+  }
+
+  return ret;
+}
+
+////////////////////////////////////////
+
+/*
+  Clear the serial port before a command, so that its response isn't mixed with anything else.
+  What the module sent meanwhile isn't thrown away: +IPD packets go to their socket queue,
+  completing the one in progress, and notification lines are handled.
+  Only what can't be stored, or isn't part of anything, is lost. In passive mode the module
+  keeps the data, and a packet never outgrows its queue: that happens in active mode only,
+  when the application hasn't read a socket, and is counted by getRxDropped().
+*/
 void ESP8266_AT_Drv::espEmptyBuf(bool warn)
 {
-  char c;
-  int i = 0;
+  if (_passthrough)
+  {
+    pumpData();
+    return;
+  }
 
-  while (espSerial->available() > 0)
+  uint32_t rescued = _rxRescued;
+  uint32_t dropped = _rxDropped;
+
+  unsigned long start = millis();
+
+  while (true)
   {
-    c = espSerial->read();
+    if (_bufPos > 0)
+    {
+      // the response would come in the middle of the packet
+      pumpPayload(true);
+      continue;
+    }
+
+    if (espSerial->available() > 0)
+    {
+      pumpChar((char) espSerial->read());
+      _rxRescued++;
+
+      start = millis();
+
+      continue;
+    }
+
+    // wait for the end of an +IPD header
+    if ( (_lineLen > 0) && (strncmp(_lineBuf, "+IPD", (_lineLen < 4) ? _lineLen : 4) == 0)
+         && (millis() - start < AT_DATA_TIMEOUT) )
+    {
+      continue;
+    }
+
+    break;
+  }
 
-    if (i > 0 and warn == true)
-      AT_LOGDEBUG0(c);
+  // a partial line is garbage
+  _rxDropped += _lineLen;
+  _lineLen = 0;
 
-    i++;
+  if ( warn && (_rxDropped != dropped) )
+  {
+    AT_LOGDEBUG1(F("Dirty characters in the serial buffer! >"), _rxDropped - dropped);
   }
 
-  if (i > 0 and warn == true)
+  if (_rxRescued != rescued)
   {
-    AT_LOGDEBUG(F(""));
-    AT_LOGDEBUG1(F("Dirty characters in the serial buffer! >"), i);
+    AT_LOGDEBUG1(F("espEmptyBuf: kept"), (_rxRescued - rescued) - (_rxDropped - dropped));
   }
 }
 
 ////////////////////////////////////////
 
+uint32_t ESP8266_AT_Drv::getRxRescued()
+{
+  return _rxRescued;
+}
+
+////////////////////////////////////////
+
+uint32_t ESP8266_AT_Drv::getRxDropped()
+{
+  return _rxDropped;
+}
+
+////////////////////////////////////////
+
 // copied from Serial::timedRead
 int ESP8266_AT_Drv::timedRead()
 {
@@ -1962,6 +3341,22 @@ int ESP8266_AT_Drv::timedRead()
 
 ////////////////////////////////////////
 
+// Read the digits starting with c. On return c is the first character after them
+long ESP8266_AT_Drv::timedReadNumber(int& c)
+{
+  long n = 0;
+
+  while ( (c >= '0') && (c <= '9') )
+  {
+    n = n * 10 + (c - '0');
+    c = timedRead();
+  }
+
+  return n;
+}
+
+////////////////////////////////////////
+
 ESP8266_AT_Drv esp8266_AT_Drv;
 
 ////////////////////////////////////////
@@ -35,6 +35,8 @@
 #include "IPAddress.h"
 
 #include "RingBuffer.h"
+#include "TagMatcher.h"
+#include "SocketBuffer.h"
 
 ////////////////////////////////////////
 
@@ -78,6 +80,58 @@ extern bool useESP32_AT;
 // maximum size of AT command
 #define CMD_BUFFER_SIZE 200
 
+// Most bytes the module takes in one AT+CIPSEND
+#define AT_SEND_MAX_SIZE 2048
+
+// ms to wait for the next byte of a +IPD packet
+#define AT_DATA_TIMEOUT 500
+
+// Active mode: bytes waiting in the serial port above which a packet is read though its socket queue
+// is full, and lost. Left there, it would overflow the port, losing bytes unnoticed. 0 if the size
+// of the port's buffer isn't known
+#ifndef AT_SERIAL_RX_HIGH_WATER
+  #if defined(SERIAL_RX_BUFFER_SIZE)
+    #define AT_SERIAL_RX_HIGH_WATER   (SERIAL_RX_BUFFER_SIZE - 16)
+  #else
+    #define AT_SERIAL_RX_HIGH_WATER   0
+  #endif
+#endif
+
+// ms a socket state learned from the module's notifications is trusted before asking AT+CIPSTATUS again
+#define AT_SOCK_RESYNC_TIME   5000
+
+// Number of unsolicited result codes kept until poll() dispatches them
+#if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+  #define AT_URC_QUEUE_SIZE   4
+#else
+  #define AT_URC_QUEUE_SIZE   8
+#endif
+
+// longest +IPD header or notification line kept by pumpData()
+#define AT_LINE_MAX_LEN 48
+
+// UART speed of the module after reset
+#define AT_DEFAULT_BAUD_RATE        115200
+
+// ms of silence before and after "+++" to leave passthrough mode
+#define AT_PASSTHROUGH_GUARD_TIME   50
+#define AT_PASSTHROUGH_EXIT_TIME    1000
+
+// Number of AT commands the asynchronous engine can hold, queued or waiting to be collected
+#if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+  #define AT_CMD_QUEUE_SIZE   2
+#else
+  #define AT_CMD_QUEUE_SIZE   4
+#endif
+
+// Results of an AT command. Values >= 0 are the index of the tag ending the response
+#define AT_CMD_OK           0
+#define AT_CMD_ERROR        1
+#define AT_CMD_FAIL         2
+#define AT_CMD_BUSY         5   // "busy p..." or "busy s...", try again later
+#define AT_CMD_TIMEOUT      -1
+#define AT_CMD_PENDING      -2
+
 ////////////////////////////////////////
 
 // KH, add UDP_MULTICAST_MODE to support MultiCast for v1.1.0
@@ -91,6 +145,31 @@ typedef enum eProtMode
 
 ////////////////////////////////////////
 
+// How the module delivers received data
+typedef enum
+{
+  AT_RECV_ACTIVE,     // pushed as +IPD packets as soon as received
+  AT_RECV_PASSIVE     // kept in the module until read with AT+CIPRECVDATA
+} tRecvMode;
+
+// Receive mode asked for at init. In active mode nothing holds the module back: a packet its
+// socket queue can't take when a command needs the serial port is lost, see getRxDropped()
+#ifndef AT_RECV_DEFAULT
+  #define AT_RECV_DEFAULT     AT_RECV_PASSIVE
+#endif
+
+////////////////////////////////////////
+
+// State of a link, as reported by the module
+typedef enum
+{
+  AT_SOCK_UNKNOWN,    // not heard of since opened or reset, ask AT+CIPSTATUS
+  AT_SOCK_CONNECTED,  // "<connId>,CONNECT", data received or AT+CIPSTART OK
+  AT_SOCK_CLOSED      // "<connId>,CLOSED" or "<connId>,CONNECT FAIL"
+} tSockState;
+
+////////////////////////////////////////
+
 typedef enum
 {
   WL_FAILURE = -1,
@@ -157,6 +236,81 @@ enum wl_tcp_state
 
 ////////////////////////////////////////
 
+// Unsolicited result codes: lines the module sends on its own
+typedef enum
+{
+  AT_URC_READY,             // "ready": the module restarted, all links are closed
+  AT_URC_WIFI_CONNECTED,    // "WIFI CONNECTED"
+  AT_URC_WIFI_GOT_IP,       // "WIFI GOT IP"
+  AT_URC_WIFI_DISCONNECT,   // "WIFI DISCONNECT", all links are closed
+  AT_URC_LINK_CONNECT,      // "<connId>,CONNECT"
+  AT_URC_LINK_CLOSED,       // "<connId>,CLOSED"
+  AT_URC_LINK_FAIL,         // "<connId>,CONNECT FAIL"
+  AT_URC_BUSY,              // "busy p..." or "busy s...", the module is still processing the previous command
+  AT_URC_STA_CONNECTED,     // "+STA_CONNECTED:<mac>", a station joined our AP
+  AT_URC_STA_DISCONNECTED,  // "+STA_DISCONNECTED:<mac>"
+  AT_URC_STA_IP,            // "+DIST_STA_IP:<mac>,<ip>", our AP gave an IP to a station
+  NUM_AT_URC
+} tATUrc;
+
+// Called from poll() for each URC received, with the link it concerns or SOCK_NOT_AVAIL.
+// It may send AT commands.
+typedef void (*ATUrcCallback)(uint8_t urc, uint8_t connId);
+
+////////////////////////////////////////
+
+// One buffer of a scatter-gather send, in RAM or PROGMEM
+typedef struct
+{
+  const void* data;
+  size_t      len;
+  bool        progmem;
+} ATIoVec;
+
+////////////////////////////////////////
+
+// Reconfigures the host serial port talking to the module, for setBaudRate()
+// flowControl: enable RTS/CTS on the host side too
+typedef void (*ATBaudRateHook)(uint32_t baud, bool flowControl);
+
+////////////////////////////////////////
+
+// Called from poll() when an asynchronous command completes, with the id returned by sendCmdAsync()
+typedef void (*ATCmdCallback)(int8_t cmdId, int result);
+
+////////////////////////////////////////
+
+typedef enum
+{
+  AT_CMD_FREE,
+  AT_CMD_QUEUED,
+  AT_CMD_SENT,
+  AT_CMD_DONE
+} ATCmdState;
+
+////////////////////////////////////////
+
+// One entry of the asynchronous AT command queue
+typedef struct
+{
+  const char*     cmd;
+  bool            progmem;        // cmd is a __FlashStringHelper
+  bool            ownsCmd;        // cmd is a heap copy, freed with the slot
+  uint8_t         state;          // ATCmdState
+  uint8_t         phase;          // sendCmdGet: 0 = start tag, 1 = end tag, 2 = rest of the response
+  uint8_t         seq;            // submission order
+  int             result;
+  unsigned int    timeout;
+  unsigned long   start;
+  const char*     startTag;
+  const char*     endTag;
+  char*           outStr;
+  int             outStrLen;
+  ATCmdCallback   callback;
+} ATCommand;
+
+////////////////////////////////////////
+
 //using IPAddress = arduino::IPAddress;
 
 class ESP8266_AT_Drv
@@ -167,7 +321,14 @@ class ESP8266_AT_Drv
     // ReInit, don't need to specify but use current espSerial
     static void wifiDriverReInit(void);
 
-    static void wifiDriverInit(Stream *espSerial);
+    /*
+       recvMode: AT_RECV_PASSIVE to pull the received data only when there is room for it.
+       Falls back to AT_RECV_ACTIVE if the firmware has no AT+CIPRECVMODE
+    */
+    static void wifiDriverInit(Stream *espSerial, uint8_t recvMode = AT_RECV_DEFAULT);
+
+    // Receive mode in use, AT_RECV_ACTIVE or AT_RECV_PASSIVE
+    static uint8_t recvMode();
 
     /* Start Wifi connection with passphrase
 
@@ -176,6 +337,12 @@ class ESP8266_AT_Drv
     */
     static bool wifiConnect(const char* ssid, const char* passphrase);
 
+    /* Same as wifiConnect, but only queues the join command and returns at once.
+
+       return: command id to pass to cmdResult(), or -1 if it can't be queued
+    */
+    static int8_t wifiConnectAsync(const char* ssid, const char* passphrase, ATCmdCallback callback = NULL);
+
     /*
        Start the Access Point
     */
@@ -297,6 +464,19 @@ class ESP8266_AT_Drv
     */
     static char* getFwVersion();
 
+    /*
+       Switch the UART to baud with AT+UART_CUR, then call hook to switch the host serial port too,
+       and check the link with "AT". If the check fails, both sides go back to the previous rate.
+       The rate isn't saved in the module, a reset goes back to AT_DEFAULT_BAUD_RATE.
+
+       param flowControl: use RTS/CTS hardware flow control, the hook must enable it on the host
+       return: true if the module answers at the new rate
+    */
+    static bool setBaudRate(uint32_t baud, ATBaudRateHook hook, bool flowControl = false);
+
+    // Current UART rate, as far as the driver knows
+    static uint32_t getBaudRate();
+
     ////////////////////////////////////////////////////////////////////////////
     // Client/Server methods
     ////////////////////////////////////////////////////////////////////////////
@@ -304,15 +484,37 @@ class ESP8266_AT_Drv
     static bool startServer(uint16_t port, uint8_t sock);
     static bool startClient(const char* host, uint16_t port, uint8_t sock, uint8_t protMode);
     static void stopClient(uint8_t sock);
+
+    /*
+       Passthrough (transparent) mode for a single TCP connection. While it is active, the data
+       written to sock goes straight to the UART and any other AT command is refused.
+       stopClient(sock) leaves it.
+    */
+    static bool startPassthrough(const char* host, uint16_t port, uint8_t sock);
+    static void stopPassthrough();
+    static bool passthrough();
     static uint8_t getServerState(uint8_t sock);
     static uint8_t getClientState(uint8_t sock);
     static bool getData(uint8_t connId, uint8_t *data, bool peek, bool* connClose);
     static int getDataBuf(uint8_t connId, uint8_t *buf, uint16_t bufSize);
+    static int getDataUntil(uint8_t connId, char terminator, uint8_t *buf, uint16_t bufSize, bool* found);
     static bool sendData(uint8_t sock, const uint8_t *data, uint16_t len);
     static bool sendData(uint8_t sock, const __FlashStringHelper *data, uint16_t len, bool appendCrLf = false);
     static bool sendDataUdp(uint8_t sock, const char* host, uint16_t port, const uint8_t *data, uint16_t len);
+
+    /*
+       Send len bytes of the buffers in iov, starting offset bytes in, with one AT+CIPSEND.
+       len is at most AT_SEND_MAX_SIZE.
+    */
+    static bool sendDataV(uint8_t sock, const ATIoVec* iov, uint8_t count, size_t offset, uint16_t len);
+
+    // Why the last sendDataV() failed: AT_CMD_BUSY, AT_CMD_ERROR, AT_CMD_TIMEOUT, or AT_CMD_OK
+    static int lastSendResult();
     static uint16_t availData(uint8_t connId);
 
+    // Look offset bytes into the queued data of connId without reading the serial port, -1 if not there yet
+    static int peekData(uint8_t connId, uint16_t offset);
+
     static bool ping(const char *host);
     static void reset();
 
@@ -322,15 +524,94 @@ class ESP8266_AT_Drv
 
     static void getRemoteIpAddress(IPAddress& ip);
     static uint16_t getRemotePort();
+    static void getRemoteIpAddress(uint8_t sock, IPAddress& ip);
+    static uint16_t getRemotePort(uint8_t sock);
+
+    // true once the module reported the socket closed and all its data was read
+    static bool linkClosed(uint8_t connId);
+
+    // Bytes found in the serial port before an AT command, which used to be thrown away,
+    // and those that still had to be: no room in the socket queue, or not data nor notification
+    static uint32_t getRxRescued();
+    static uint32_t getRxDropped();
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Asynchronous AT commands
+    ////////////////////////////////////////////////////////////////////////////
+
+    /*
+       Queue an AT command without waiting for its response. A RAM string is copied.
+       The command is sent and its response parsed by poll(), one command at a time.
+       If callback is given, it is called on completion and the slot is released,
+       otherwise the result is collected with cmdResult(). With the queue full, the oldest
+       result not collected yet is dropped to make room.
+
+       return: command id, or -1 if the queue is full of commands not completed yet
+    */
+    static int8_t sendCmdAsync(const __FlashStringHelper* cmd, unsigned int timeout = 1000, ATCmdCallback callback = NULL);
+    static int8_t sendCmdAsync(const char* cmd, unsigned int timeout = 1000, ATCmdCallback callback = NULL);
+
+    /*
+       return: AT_CMD_PENDING while the command runs, else its result (AT_CMD_OK, AT_CMD_TIMEOUT, ...).
+       Reading a result releases the slot.
+    */
+    static int cmdResult(int8_t cmdId);
+    static bool cmdPending(int8_t cmdId);
+
+    // Advance the command queue and dispatch the URCs received. Never blocks, call it often from loop()
+    static void poll();
+
+    // Call callback from poll() each time the module sends urc, NULL to stop
+    static void onUrc(uint8_t urc, ATUrcCallback callback);
 
     ////////////////////////////////////////
 
   private:
     static Stream *espSerial;
 
+    // +IPD packet being moved to its socket queue, _bufPos bytes still in the UART
     static long     _bufPos;
     static uint8_t  _connId;
 
+    static AT_SocketBuffer  _sockRx[MAX_SOCK_NUM];
+    static uint8_t          _sockState[MAX_SOCK_NUM];
+    static unsigned long    _sockStateMillis[MAX_SOCK_NUM];
+    static uint8_t          _sockRemoteIp[MAX_SOCK_NUM][4];
+    static uint16_t         _sockRemotePort[MAX_SOCK_NUM];
+
+    // passive mode: bytes the module holds for each socket
+    static uint16_t         _sockPending[MAX_SOCK_NUM];
+    static uint8_t          _recvMode;
+    static uint8_t          _recvModeWanted;
+
+    static uint32_t         _baudRate;
+    static bool             _flowControl;
+
+    // Wi-Fi state learned from the URCs
+    static uint8_t          _wifiState;
+    static unsigned long    _wifiStateMillis;
+
+    // URCs received, waiting to be dispatched by poll()
+    static ATUrcCallback    _urcCallback[NUM_AT_URC];
+    static uint8_t          _urcQueue[AT_URC_QUEUE_SIZE][2];
+    static uint8_t          _urcCount;
+    static bool             _urcDispatching;
+
+    // passthrough mode, all the data belongs to _ptSock
+    static bool             _passthrough;
+    static uint8_t          _ptSock;
+    static unsigned long    _frameMillis;
+
+    static int              _lastSendResult;
+
+    // bytes found in the serial port before a command: all of them, and those lost
+    static uint32_t         _rxRescued;
+    static uint32_t         _rxDropped;
+
+    // line received outside of AT commands or during one, up to now
+    static char     _lineBuf[AT_LINE_MAX_LEN];
+    static uint8_t  _lineLen;
+
     static uint16_t _remotePort;
     static uint8_t  _remoteIp[WL_IPV4_LENGTH];
 
@@ -348,9 +629,12 @@ class ESP8266_AT_Drv
     static uint8_t  _mac[WL_MAC_ADDR_LENGTH];
     static uint8_t  _localIp[WL_IPV4_LENGTH];
 
-    // the ring buffer is used to search the tags in the stream
+    // the ring buffer keeps the response, to extract the strings between tags
     static AT_RingBuffer ringBuf;
 
+    // searches the tags in the stream
+    static AT_TagMatcher tagMatcher;
+
     static int sendCmd(const char* cmd, int timeout = 1000);
     static int sendCmd(const char* cmd, int timeout, ...);
 
@@ -365,10 +649,50 @@ class ESP8266_AT_Drv
                            const __FlashStringHelper* endTag, char* outStr, int outStrLen);
 
     static int readUntil(unsigned int timeout, const char* tag = NULL, bool findTags = true);
+    static void readBegin(const char* tag, bool findTags);
+    static int readFeed(char c);
+
+    // tag too long for tagMatcher, searched in ringBuf instead
+    static const char* _readSlowTag;
+
+    static ATCommand  _cmdQueue[AT_CMD_QUEUE_SIZE];
+    static int8_t     _cmdCurrent;
+    static uint8_t    _cmdSeq;
+
+    static int8_t queueCmd(const char* cmd, bool progmem, unsigned int timeout, const char* startTag, const char* endTag,
+                           char* outStr, int outStrLen, ATCmdCallback callback);
+    static int8_t freeCmdSlot(bool wait);
+    static void releaseCmd(int8_t cmdId);
+    static bool startNextCmd();
+    static void finishCmd(int result);
+    static int waitCmd(int8_t cmdId);
+    static void waitCmdIdle();
 
     static void espEmptyBuf(bool warn = true);
 
     static int timedRead();
+    static long timedReadNumber(int& c);
+
+    static int getDataSpan(uint8_t connId, uint8_t *buf, uint16_t bufSize, int terminator, bool* found);
+    static void pumpData();
+    static void pumpChar(char c);
+    static bool pumpPayload(bool drain);
+    static void startPacket(const char* hdr);
+    static void parseRemote(const char* p, uint8_t* ip, uint16_t* port);
+    static void handleLine();
+    static void feedLine(char c);
+    static void queueUrc(uint8_t urc, uint8_t connId);
+    static void dispatchUrc();
+    static void resetSocket(uint8_t sock);
+    static void setSockState(uint8_t sock, uint8_t state);
+    static bool pullPending();
+    static int pullData(uint8_t sock);
+    static void syncRecvLen();
+    static bool passthroughActive();
+    static void writeIoVec(const ATIoVec* iov, uint8_t count, size_t offset, uint16_t len);
+    static int readPrompt(unsigned int timeout);
+    static bool checkLink();
+    static bool setUart(uint32_t baud, bool flowControl);
 
     ////////////////////////////////////////
 
@@ -34,6 +34,128 @@
 
 ////////////////////////////////////////
 
+// How on() compiles "{name}" and "{name...}" path parameters into its uri
+#define URI_PATTERN_SEGMENT     '\x01'
+#define URI_PATTERN_REST        '\x02'
+
+////////////////////////////////////////
+
+/*
+   Match uri against a compiled pattern. A segment parameter takes what is up to the next '/' or
+   the next character of the pattern, a rest parameter all that is left; neither can be empty.
+   The parameters go to args as start and end offsets in uri, up to maxArgs of them.
+   Returns how many there are, -1 if uri does not match.
+*/
+static int matchUriPattern(const char* pattern, const char* uri, uint16_t (*args)[2], uint8_t maxArgs)
+{
+  const char* start = uri;
+  int count = 0;
+
+  while (*pattern)
+  {
+    char c = *pattern++;
+
+    if ( (c != URI_PATTERN_SEGMENT) && (c != URI_PATTERN_REST) )
+    {
+      if (*uri++ != c)
+        return -1;
+
+      continue;
+    }
+
+    const char* end = uri;
+
+    if (c == URI_PATTERN_REST)
+    {
+      end += strlen(uri);
+    }
+    else
+    {
+      while (*end && (*end != '/') && (*end != *pattern))
+        end++;
+    }
+
+    if (end == uri)
+      return -1;
+
+    if (count < maxArgs)
+    {
+      args[count][0] = uri - start;
+      args[count][1] = end - start;
+    }
+
+    count++;
+    uri = end;
+  }
+
+  return (*uri == 0) ? count : -1;
+}
+
+////////////////////////////////////////
+
+// Same as matchUriPattern(), for a pattern in flash still written as "/api/relay/{id}/state"
+static int matchUriPattern_P(PGM_P pattern, const char* uri, uint16_t (*args)[2], uint8_t maxArgs)
+{
+  const char* start = uri;
+  int count = 0;
+  char c;
+
+  while ( (c = pgm_read_byte(pattern++)) )
+  {
+    // "/path/*" matches every uri starting with "/path"
+    if ( (c == '/') && (pgm_read_byte(pattern) == '*') && !pgm_read_byte(pattern + 1) )
+      return count;
+
+    if (c != '{')
+    {
+      if (*uri++ != c)
+        return -1;
+
+      continue;
+    }
+
+    uint8_t dots = 0;
+
+    while ( (c = pgm_read_byte(pattern)) && (c != '}') )
+    {
+      dots = (c == '.') ? dots + 1 : 0;
+      pattern++;
+    }
+
+    if (c)
+      pattern++;
+
+    const char* end = uri;
+    char stop = pgm_read_byte(pattern);
+
+    if (dots >= 3)
+    {
+      end += strlen(uri);
+    }
+    else
+    {
+      while (*end && (*end != '/') && (*end != stop))
+        end++;
+    }
+
+    if (end == uri)
+      return -1;
+
+    if (count < maxArgs)
+    {
+      args[count][0] = uri - start;
+      args[count][1] = end - start;
+    }
+
+    count++;
+    uri = end;
+  }
+
+  return (*uri == 0) ? count : -1;
+}
+
+////////////////////////////////////////
+
 class FunctionRequestHandler : public RequestHandler
 {
   public:
@@ -47,6 +169,19 @@ class FunctionRequestHandler : public RequestHandler
       , _uri(uri)
       , _method(method)
     {
+      // "/path/*" matches every uri starting with "/path"
+      _prefixLength = _uri.endsWith("/*") ? _uri.length() - 2 : -1;
+      _isPattern    = false;
+
+      if (_uri.indexOf('{') >= 0)
+        _compilePattern();
+    }
+
+    ////////////////////////////////////////
+
+    const String& uri() const
+    {
+      return _uri;
     }
 
     ////////////////////////////////////////
@@ -56,17 +191,14 @@ class FunctionRequestHandler : public RequestHandler
       if (_method != HTTP_ANY && _method != requestMethod)
         return false;
 
+      if (_isPattern)
+        return (matchUriPattern(_uri.c_str(), requestUri.c_str(), NULL, 0) >= 0);
+
       if (requestUri == _uri)
         return true;
 
-      if (_uri.endsWith("/*"))
-      {
-        String _uristart = _uri;
-        _uristart.replace("/*", "");
-
-        if (requestUri.startsWith(_uristart))
-          return true;
-      }
+      if ( (_prefixLength >= 0) && !strncmp(requestUri.c_str(), _uri.c_str(), _prefixLength) )
+        return true;
 
       return false;
     }
@@ -108,20 +240,216 @@ class FunctionRequestHandler : public RequestHandler
     ////////////////////////////////////////
 
   protected:
+
+    // "/api/relay/{id}/state" becomes "/api/relay/" URI_PATTERN_SEGMENT "/state"
+    void _compilePattern()
+    {
+      String pattern;
+      int pos = 0;
+      int open;
+
+      pattern.reserve(_uri.length());
+
+      while ( (open = _uri.indexOf('{', pos)) >= 0 )
+      {
+        int close = _uri.indexOf('}', open);
+
+        if (close < 0)
+          break;
+
+        pattern += _uri.substring(pos, open);
+        pattern += (_uri.substring(close - 3, close) == "...") ? URI_PATTERN_REST : URI_PATTERN_SEGMENT;
+        pos = close + 1;
+      }
+
+      pattern += _uri.substring(pos);
+
+      _uri          = pattern;
+      _prefixLength = -1;
+      _isPattern    = true;
+    }
+
+    ////////////////////////////////////////
+
     ESP8266_AT_WebServer::THandlerFunction _fn;
     ESP8266_AT_WebServer::THandlerFunction _ufn;
     String _uri;
     HTTPMethod _method;
+    int _prefixLength;
+    bool _isPattern;
 };
 
 ////////////////////////////////////////
 
+// The ATRoute table given to on(), searched in place in flash
+class RouteTableRequestHandler : public RequestHandler
+{
+  public:
+
+    ////////////////////////////////////////
+
+    RouteTableRequestHandler(const ATRoute* routes, size_t count)
+      : _routes(routes)
+      , _count(count)
+    {
+    }
+
+    ////////////////////////////////////////
+
+    // Index of the first route for requestMethod and requestUri, -1 if none. Its path parameters go to args.
+    int find(const HTTPMethod& requestMethod, const char* requestUri, uint16_t (*args)[2], uint8_t maxArgs, int* argCount)
+    {
+      for (size_t i = 0; i < _count; i++)
+      {
+        uint8_t method = pgm_read_byte(&_routes[i].method);
+
+        if ( (method != HTTP_ANY) && (method != requestMethod) )
+          continue;
+
+        int count = matchUriPattern_P(_routes[i].uri, requestUri, args, maxArgs);
+
+        if (count >= 0)
+        {
+          if (argCount)
+            *argCount = count;
+
+          return i;
+        }
+      }
+
+      return -1;
+    }
+
+    ////////////////////////////////////////
+
+    bool canHandle(const HTTPMethod& requestMethod, const String& requestUri) override
+    {
+      return (find(requestMethod, requestUri.c_str(), NULL, 0, NULL) >= 0);
+    }
+
+    ////////////////////////////////////////
+
+    bool handle(ESP8266_AT_WebServer& server, const HTTPMethod& requestMethod, const String& requestUri) override
+    {
+      ESP_AT_UNUSED(server);
+
+      int i = find(requestMethod, requestUri.c_str(), NULL, 0, NULL);
+
+      if (i < 0)
+        return false;
+
+      ATRouteFunction fn;
+
+      memcpy_P(&fn, &_routes[i].fn, sizeof(fn));
+      fn();
+
+      return true;
+    }
+
+    ////////////////////////////////////////
+
+  protected:
+
+    const ATRoute* _routes;
+    size_t _count;
+};
+
+////////////////////////////////////////
+
+// A gzip compressed flash asset, sent as-is to the clients which accept it, see onAsset_P()
+class AssetRequestHandler : public RequestHandler
+{
+  public:
+
+    ////////////////////////////////////////
+
+    AssetRequestHandler(const String& uri, PGM_P contentType, PGM_P gzipped, size_t gzippedLength,
+                        PGM_P plain, size_t plainLength)
+      : _uri(uri)
+      , _contentType(contentType)
+      , _gzipped(gzipped)
+      , _gzippedLength(gzippedLength)
+      , _plain(plain)
+      , _plainLength(plainLength)
+    {
+    }
+
+    ////////////////////////////////////////
+
+    const String& uri() const
+    {
+      return _uri;
+    }
+
+    ////////////////////////////////////////
+
+    bool canHandle(const HTTPMethod& requestMethod, const String& requestUri) override
+    {
+      return (requestMethod == HTTP_GET) && (requestUri == _uri);
+    }
+
+    ////////////////////////////////////////
+
+    bool handle(ESP8266_AT_WebServer& server, const HTTPMethod& requestMethod, const String& requestUri) override
+    {
+      if (!canHandle(requestMethod, requestUri))
+        return false;
+
+      // Caches must not give one client's encoding to another
+      server.sendHeader("Vary", "Accept-Encoding");
+
+      if (server.acceptsGzip())
+      {
+        server.sendHeader("Content-Encoding", "gzip");
+        server.send_P(200, _contentType, _gzipped, _gzippedLength);
+      }
+      else if (_plain)
+      {
+        server.send_P(200, _contentType, _plain, _plainLength);
+      }
+      else
+      {
+        server.send(406, "text/plain", "gzip encoding required");
+      }
+
+      return true;
+    }
+
+    ////////////////////////////////////////
+
+  protected:
+
+    String _uri;
+    PGM_P _contentType;
+    PGM_P _gzipped;
+    size_t _gzippedLength;
+    PGM_P _plain;
+    size_t _plainLength;
+};
+
+////////////////////////////////////////
+
+// Files of an ATFileSystem, see serveStatic()
 class StaticRequestHandler : public RequestHandler
 {
   public:
 
     ////////////////////////////////////////
 
+    StaticRequestHandler(ATFileSystem& fs, const char* path, const char* uri, const char* cache_header)
+      : _fs(fs)
+      , _uri(uri)
+      , _path(path)
+      , _cache_header(cache_header)
+    {
+      _isFile = fs.open(path);
+      fs.close();
+
+      _baseUriLength = _uri.length();
+    }
+
+    ////////////////////////////////////////
+
     bool canHandle(const HTTPMethod& requestMethod, const String& requestUri) override
     {
       if (requestMethod != HTTP_GET)
@@ -135,6 +463,89 @@ class StaticRequestHandler : public RequestHandler
 
     ////////////////////////////////////////
 
+    bool handle(ESP8266_AT_WebServer& server, const HTTPMethod& requestMethod, const String& requestUri) override
+    {
+      using namespace mime;
+
+      if (!canHandle(requestMethod, requestUri))
+        return false;
+
+      String path(_path);
+
+      if (!_isFile)
+      {
+        // A directory gets its index.htm
+        String file = requestUri;
+
+        if (file.endsWith("/"))
+          file += "index.htm";
+
+        file = file.substring(_baseUriLength);
+
+        // With or without the '/' ending path
+        if (!path.endsWith("/") && !file.startsWith("/"))
+          path += '/';
+
+        path += file;
+      }
+
+      String contentType = getContentType(path);
+      bool gzipped       = false;
+
+      if (!path.endsWith(mimeTable[gz].endsWith) && server.acceptsGzip()
+          && _fs.open((path + mimeTable[gz].endsWith).c_str()))
+      {
+        gzipped = true;
+      }
+      else if (!_fs.open(path.c_str()))
+      {
+        return false;
+      }
+
+      uint32_t size     = _fs.size();
+      uint32_t modified = _fs.lastModified();
+      uint32_t hash     = ESP8266_AT_WebServer::_hash(NULL, 0, false);
+      bool tagged       = true;
+
+      if (modified)
+      {
+        hash = ESP8266_AT_WebServer::_hash((const uint8_t*) &modified, sizeof(modified), false, hash);
+      }
+      else if (size <= HTTP_ETAG_MAX_FILE_SIZE)
+      {
+        // Reading it twice costs less than sending it again, up to a point
+        uint8_t* buffer = ESP8266_AT_WebServer::_downloadBuffer();
+        size_t count;
+
+        while ( (count = _fs.read(buffer, HTTP_DOWNLOAD_UNIT_SIZE)) )
+          hash = ESP8266_AT_WebServer::_hash(buffer, count, false, hash);
+
+        _fs.seek(0);
+      }
+      else
+      {
+        tagged = false;
+      }
+
+      if (_cache_header.length())
+        server.sendHeader("Cache-Control", _cache_header);
+
+      if (gzipped)
+      {
+        server.sendHeader("Content-Encoding", "gzip");
+        server.sendHeader("Vary", "Accept-Encoding");
+      }
+
+      if (!tagged || !server._etag(hash, size))
+        server._streamBody(_fs, size, contentType);
+
+      _fs.close();
+
+      return true;
+    }
+
+    ////////////////////////////////////////
+
     static String getContentType(const String& path)
     {
       using namespace mime;
@@ -161,6 +572,7 @@ class StaticRequestHandler : public RequestHandler
 
   protected:
 
+    ATFileSystem& _fs;
     String _uri;
     String _path;
     String _cache_header;
@@ -0,0 +1,167 @@
+/****************************************************************************************************************************
+  SocketBuffer.cpp - Dead simple web-server.
+  For ESP8266/ESP32 AT-command running shields
+
+  ESP8266_AT_WebServer is a library for the ESP8266/ESP32 AT-command shields to run WebServer
+  Based on and modified from ESP8266 https://github.com/esp8266/Arduino/releases
+  Built by Khoi Hoang https://github.com/khoih-prog/ESP8266_AT_WebServer
+  Licensed under MIT license
+
+  Original author:
+  @file       Esp8266WebServer.h
+  @author     Ivan Grokhotkov
+
+  Version: 1.7.1
+
+  Version Modified By   Date      Comments
+  ------- -----------  ---------- -----------
+  1.0.0   K Hoang      12/02/2020 Initial coding for Arduino Mega, Teensy, etc
+  ...
+  1.6.0   K Hoang      16/11/2022 Fix severe limitation to permit sending larger data than 2K buffer. Add CORS
+  1.7.0   K Hoang      16/01/2023 Add support to WizNet WizFi360 such as WIZNET_WIZFI360_EVB_PICO
+  1.7.1   K Hoang      17/01/2023 Fix AP and version bugs for WizNet WizFi360
+ *****************************************************************************************************************************/
+
+#include "SocketBuffer.h"
+
+#include <Arduino.h>
+
+////////////////////////////////////////
+
+AT_SocketBuffer::AT_SocketBuffer()
+{
+  clear();
+}
+
+////////////////////////////////////////
+
+void AT_SocketBuffer::clear()
+{
+  _head  = 0;
+  _count = 0;
+}
+
+////////////////////////////////////////
+
+bool AT_SocketBuffer::push(uint8_t c)
+{
+  if (_count >= AT_SOCK_RX_BUFFER_SIZE)
+    return false;
+
+  uint16_t tail = _head + _count;
+
+  if (tail >= AT_SOCK_RX_BUFFER_SIZE)
+    tail -= AT_SOCK_RX_BUFFER_SIZE;
+
+  _buf[tail] = c;
+  _count++;
+
+  return true;
+}
+
+////////////////////////////////////////
+
+int AT_SocketBuffer::read()
+{
+  if (_count == 0)
+    return -1;
+
+  uint8_t c = _buf[_head];
+
+  if (++_head >= AT_SOCK_RX_BUFFER_SIZE)
+    _head = 0;
+
+  _count--;
+
+  return c;
+}
+
+////////////////////////////////////////
+
+int AT_SocketBuffer::peek() const
+{
+  if (_count == 0)
+    return -1;
+
+  return _buf[_head];
+}
+
+////////////////////////////////////////
+
+int AT_SocketBuffer::peekAt(uint16_t offset) const
+{
+  if (offset >= _count)
+    return -1;
+
+  uint16_t pos = _head + offset;
+
+  if (pos >= AT_SOCK_RX_BUFFER_SIZE)
+    pos -= AT_SOCK_RX_BUFFER_SIZE;
+
+  return _buf[pos];
+}
+
+////////////////////////////////////////
+
+uint16_t AT_SocketBuffer::read(uint8_t* buf, uint16_t size, int terminator, bool* found)
+{
+  uint16_t count = 0;
+
+  if (found)
+    *found = false;
+
+  while ( (count < size) && (_count > 0) )
+  {
+    // Contiguous part, up to the end of the buffer
+    uint16_t span = AT_SOCK_RX_BUFFER_SIZE - _head;
+
+    if (span > _count)
+      span = _count;
+
+    if (span > size - count)
+      span = size - count;
+
+    if (terminator < 0)
+    {
+      memcpy(buf + count, &_buf[_head], span);
+    }
+    else
+    {
+      const uint8_t* hit = (const uint8_t*) memchr(&_buf[_head], terminator, span);
+
+      if (hit != NULL)
+      {
+        uint16_t len = hit - &_buf[_head];
+
+        memcpy(buf + count, &_buf[_head], len);
+        count += len;
+
+        // Consume the terminator too
+        len++;
+        _head += len;
+        _count -= len;
+
+        if (_head >= AT_SOCK_RX_BUFFER_SIZE)
+          _head -= AT_SOCK_RX_BUFFER_SIZE;
+
+        if (found)
+          *found = true;
+
+        return count;
+      }
+
+      memcpy(buf + count, &_buf[_head], span);
+    }
+
+    count  += span;
+    _head  += span;
+    _count -= span;
+
+    if (_head >= AT_SOCK_RX_BUFFER_SIZE)
+      _head -= AT_SOCK_RX_BUFFER_SIZE;
+  }
+
+  return count;
+}
+
+////////////////////////////////////////
@@ -0,0 +1,86 @@
+/****************************************************************************************************************************
+  SocketBuffer.h - Dead simple web-server.
+  For ESP8266/ESP32 AT-command running shields
+
+  ESP8266_AT_WebServer is a library for the ESP8266/ESP32 AT-command shields to run WebServer
+  Based on and modified from ESP8266 https://github.com/esp8266/Arduino/releases
+  Built by Khoi Hoang https://github.com/khoih-prog/ESP8266_AT_WebServer
+  Licensed under MIT license
+
+  Original author:
+  @file       Esp8266WebServer.h
+  @author     Ivan Grokhotkov
+
+  Version: 1.7.1
+
+  Version Modified By   Date      Comments
+  ------- -----------  ---------- -----------
+  1.0.0   K Hoang      12/02/2020 Initial coding for Arduino Mega, Teensy, etc
+  ...
+  1.6.0   K Hoang      16/11/2022 Fix severe limitation to permit sending larger data than 2K buffer. Add CORS
+  1.7.0   K Hoang      16/01/2023 Add support to WizNet WizFi360 such as WIZNET_WIZFI360_EVB_PICO
+  1.7.1   K Hoang      17/01/2023 Fix AP and version bugs for WizNet WizFi360
+ *****************************************************************************************************************************/
+
+#ifndef SocketBuffer_h
+#define SocketBuffer_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+////////////////////////////////////////
+
+// Bytes of received data buffered for each socket
+#ifndef AT_SOCK_RX_BUFFER_SIZE
+  #if ( defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(STM32F1) )
+    #define AT_SOCK_RX_BUFFER_SIZE      128
+  #elif ( defined(STM32F2) || defined(STM32F3) )
+    #define AT_SOCK_RX_BUFFER_SIZE      256
+  #else
+    #define AT_SOCK_RX_BUFFER_SIZE      1024
+  #endif
+#endif
+
+////////////////////////////////////////
+
+// FIFO of the data received for one socket
+class AT_SocketBuffer
+{
+  public:
+
+    AT_SocketBuffer();
+
+    void clear();
+
+    uint16_t available() const
+    {
+      return _count;
+    }
+
+    uint16_t free() const
+    {
+      return AT_SOCK_RX_BUFFER_SIZE - _count;
+    }
+
+    bool push(uint8_t c);
+
+    // Returns -1 if empty
+    int read();
+    int peek() const;
+
+    // Byte offset positions past the oldest one, -1 if not there yet
+    int peekAt(uint16_t offset) const;
+
+    // Copy up to size bytes. With a terminator >= 0, stop after it, consumed but not copied.
+    uint16_t read(uint8_t* buf, uint16_t size, int terminator = -1, bool* found = NULL);
+
+  private:
+
+    uint8_t   _buf[AT_SOCK_RX_BUFFER_SIZE];
+    uint16_t  _head;
+    uint16_t  _count;
+};
+
+////////////////////////////////////////
+
+#endif    //SocketBuffer_h
@@ -0,0 +1,218 @@
+/****************************************************************************************************************************
+  TagMatcher.cpp - Dead simple web-server.
+  For ESP8266/ESP32 AT-command running shields
+
+  ESP8266_AT_WebServer is a library for the ESP8266/ESP32 AT-command shields to run WebServer
+  Based on and modified from ESP8266 https://github.com/esp8266/Arduino/releases
+  Built by Khoi Hoang https://github.com/khoih-prog/ESP8266_AT_WebServer
+  Licensed under MIT license
+
+  Original author:
+  @file       Esp8266WebServer.h
+  @author     Ivan Grokhotkov
+
+  Version: 1.7.1
+
+  Version Modified By   Date      Comments
+  ------- -----------  ---------- -----------
+  1.0.0   K Hoang      12/02/2020 Initial coding for Arduino Mega, Teensy, etc
+  ...
+  1.6.0   K Hoang      16/11/2022 Fix severe limitation to permit sending larger data than 2K buffer. Add CORS
+  1.7.0   K Hoang      16/01/2023 Add support to WizNet WizFi360 such as WIZNET_WIZFI360_EVB_PICO
+  1.7.1   K Hoang      17/01/2023 Fix AP and version bugs for WizNet WizFi360
+ *****************************************************************************************************************************/
+
+#include "TagMatcher.h"
+#include "ESP8266_AT_Debug.h"
+
+#include <Arduino.h>
+
+////////////////////////////////////////
+
+AT_TagMatcher::AT_TagMatcher(const char* const* tags, uint8_t numTags)
+{
+  _tags     = tags;
+  _numTags  = numTags;
+  _built    = false;
+  _findTags = false;
+  _state    = 0;
+  _tag      = NULL;
+  _tagLen   = 0;
+  _tagPos   = 0;
+}
+
+////////////////////////////////////////
+
+// Build the trie and its failure links. Done on first use, not in the constructor,
+// to not depend on the initialization order of the tags
+void AT_TagMatcher::build()
+{
+  _numStates  = 1;
+  _label[0]   = 0;
+  _child[0]   = 0;
+  _sibling[0] = 0;
+  _fail[0]    = 0;
+  _out[0]     = -1;
+
+  for (uint8_t i = 0; i < _numTags; i++)
+  {
+    uint8_t state = 0;
+
+    for (const char* p = _tags[i]; *p; p++)
+    {
+      uint8_t next = _child[state];
+
+      while (next && (_label[next] != *p))
+        next = _sibling[next];
+
+      if (next == 0)
+      {
+        if (_numStates >= AT_TAG_MAX_STATES)
+        {
+          // Every command waiting for this tag would time out
+          AT_LOGERROR1(F("AT_TagMatcher: Increase AT_TAG_MAX_STATES, tag never found:"), i);
+          state = 0;
+          break;
+        }
+
+        next = _numStates++;
+
+        _label[next]   = *p;
+        _child[next]   = 0;
+        _sibling[next] = _child[state];
+        _out[next]     = -1;
+        _child[state]  = next;
+      }
+
+      state = next;
+    }
+
+    if ( (state != 0) && (_out[state] < 0) )
+      _out[state] = i;
+  }
+
+  // Breadth first, so that the failure state of a node is always complete before the node
+  uint8_t queue[AT_TAG_MAX_STATES];
+  uint8_t head = 0;
+  uint8_t tail = 0;
+
+  for (uint8_t s = _child[0]; s; s = _sibling[s])
+  {
+    _fail[s] = 0;
+    queue[tail++] = s;
+  }
+
+  while (head < tail)
+  {
+    uint8_t state = queue[head++];
+
+    for (uint8_t s = _child[state]; s; s = _sibling[s])
+    {
+      _fail[s] = step(_fail[state], _label[s]);
+
+      // A tag ending here also ends every shorter tag which is a suffix of it, report the first one
+      int8_t out = _out[_fail[s]];
+
+      if ( (out >= 0) && ( (_out[s] < 0) || (out < _out[s]) ) )
+        _out[s] = out;
+
+      queue[tail++] = s;
+    }
+  }
+
+  _built = true;
+}
+
+////////////////////////////////////////
+
+uint8_t AT_TagMatcher::step(uint8_t state, char c)
+{
+  while (true)
+  {
+    for (uint8_t s = _child[state]; s; s = _sibling[s])
+    {
+      if (_label[s] == c)
+        return s;
+    }
+
+    if (state == 0)
+      return 0;
+
+    state = _fail[state];
+  }
+}
+
+////////////////////////////////////////
+
+bool AT_TagMatcher::begin(const char* tag, bool findTags)
+{
+  if (!_built)
+    build();
+
+  _state    = 0;
+  _findTags = findTags;
+  _tag      = NULL;
+  _tagPos   = 0;
+
+  if (tag == NULL)
+    return true;
+
+  size_t len = strlen(tag);
+
+  if ( (len == 0) || (len > AT_TAG_MAX_LEN) )
+    return (len == 0);
+
+  // KMP failure function: longest proper prefix of tag[0..i] which is also its suffix
+  _tag        = tag;
+  _tagLen     = len;
+  _tagFail[0] = 0;
+
+  uint8_t k = 0;
+
+  for (uint8_t i = 1; i < _tagLen; i++)
+  {
+    while ( (k > 0) && (tag[i] != tag[k]) )
+      k = _tagFail[k - 1];
+
+    if (tag[i] == tag[k])
+      k++;
+
+    _tagFail[i] = k;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////
+
+int AT_TagMatcher::push(char c)
+{
+  int ret = -1;
+
+  if (_tag != NULL)
+  {
+    while ( (_tagPos > 0) && (_tag[_tagPos] != c) )
+      _tagPos = _tagFail[_tagPos - 1];
+
+    if (_tag[_tagPos] == c)
+      _tagPos++;
+
+    if (_tagPos == _tagLen)
+    {
+      ret = _numTags;
+      _tagPos = _tagFail[_tagLen - 1];
+    }
+  }
+
+  if (_findTags)
+  {
+    _state = step(_state, c);
+
+    if (_out[_state] >= 0)
+      ret = _out[_state];
+  }
+
+  return ret;
+}
+
+////////////////////////////////////////
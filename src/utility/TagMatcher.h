@@ -0,0 +1,92 @@
+/****************************************************************************************************************************
+  TagMatcher.h - Dead simple web-server.
+  For ESP8266/ESP32 AT-command running shields
+
+  ESP8266_AT_WebServer is a library for the ESP8266/ESP32 AT-command shields to run WebServer
+  Based on and modified from ESP8266 https://github.com/esp8266/Arduino/releases
+  Built by Khoi Hoang https://github.com/khoih-prog/ESP8266_AT_WebServer
+  Licensed under MIT license
+
+  Original author:
+  @file       Esp8266WebServer.h
+  @author     Ivan Grokhotkov
+
+  Version: 1.7.1
+
+  Version Modified By   Date      Comments
+  ------- -----------  ---------- -----------
+  1.0.0   K Hoang      12/02/2020 Initial coding for Arduino Mega, Teensy, etc
+  ...
+  1.6.0   K Hoang      16/11/2022 Fix severe limitation to permit sending larger data than 2K buffer. Add CORS
+  1.7.0   K Hoang      16/01/2023 Add support to WizNet WizFi360 such as WIZNET_WIZFI360_EVB_PICO
+  1.7.1   K Hoang      17/01/2023 Fix AP and version bugs for WizNet WizFi360
+ *****************************************************************************************************************************/
+
+#ifndef TagMatcher_h
+#define TagMatcher_h
+
+#include <stdint.h>
+
+////////////////////////////////////////
+
+// Trie nodes for the fixed tags, one per character of the tags plus the root.
+// ESPTAGS use 44 of them, a tag which doesn't fit is logged as an error and never found.
+#ifndef AT_TAG_MAX_STATES
+  #define AT_TAG_MAX_STATES     48
+#endif
+
+// Longest per-call tag handled by the automaton
+#ifndef AT_TAG_MAX_LEN
+  #define AT_TAG_MAX_LEN        32
+#endif
+
+////////////////////////////////////////
+
+/*
+  Finds the tags ending an AT response while the characters arrive, one push() per character.
+  The fixed tags are matched by an Aho-Corasick automaton built once, the per-call tag by a
+  KMP automaton built by begin(). Both take amortized constant time per character.
+*/
+class AT_TagMatcher
+{
+  public:
+
+    AT_TagMatcher(const char* const* tags, uint8_t numTags);
+
+    // Start a new search. tag is searched besides the fixed tags and may be NULL.
+    // Returns false if tag is too long to be searched here.
+    bool begin(const char* tag, bool findTags);
+
+    // Returns the index of the fixed tag just completed, numTags for the begin() tag, or -1.
+    // As in readUntil(), a fixed tag wins over the begin() tag.
+    int push(char c);
+
+  private:
+
+    void build();
+    uint8_t step(uint8_t state, char c);
+
+    const char* const* _tags;
+    uint8_t _numTags;
+    bool    _built;
+    bool    _findTags;
+
+    // Trie of the fixed tags, state 0 is the root
+    uint8_t _numStates;
+    uint8_t _state;
+    char    _label[AT_TAG_MAX_STATES];
+    uint8_t _child[AT_TAG_MAX_STATES];
+    uint8_t _sibling[AT_TAG_MAX_STATES];
+    uint8_t _fail[AT_TAG_MAX_STATES];
+    int8_t  _out[AT_TAG_MAX_STATES];
+
+    // Per-call tag
+    const char* _tag;
+    uint8_t _tagLen;
+    uint8_t _tagPos;
+    uint8_t _tagFail[AT_TAG_MAX_LEN];
+};
+
+////////////////////////////////////////
+
+#endif    //TagMatcher_h